@@ -0,0 +1,120 @@
+/* 
+ * Copyright (C) 2015 Johannes Schwab
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "BufferPool.hpp"
+
+#include <new>
+
+Buffer *BufferPool::freeList = nullptr;
+size_t BufferPool::buffersInUse = 0;
+size_t BufferPool::buffersAllocated = 0;
+size_t BufferPool::highWaterMark = 0;
+bool BufferPool::threadSafe = false;
+std::mutex BufferPool::mutex;
+
+constexpr size_t BufferPool::bufferSize;
+constexpr size_t BufferPool::buffersPerSlab;
+
+/**
+ * Size of a pooled buffer including its header,
+ * rounded up to keep the headers aligned.
+ */
+static constexpr size_t pooledStride =
+	(sizeof(Buffer) + BufferPool::bufferSize + alignof(Buffer) - 1)
+	/ alignof(Buffer) * alignof(Buffer);
+
+void BufferPool::grow() {
+	uint8_t *slab = static_cast<uint8_t*>(
+			::operator new(pooledStride * buffersPerSlab)
+	);
+
+	for (size_t i = 0; i < buffersPerSlab; ++i) {
+		Buffer *buffer = new (slab + i * pooledStride) Buffer;
+		buffer->refCount = 0;
+		buffer->capacity = bufferSize;
+		buffer->pooled = true;
+		buffer->nextFree = freeList;
+		freeList = buffer;
+	}
+
+	buffersAllocated += buffersPerSlab;
+}
+
+Buffer* BufferPool::acquire(size_t len) {
+	Buffer *buffer;
+
+	if (len > bufferSize) {
+		buffer = new (::operator new(sizeof(Buffer) + len)) Buffer;
+		buffer->capacity = len;
+		buffer->pooled = false;
+	} else {
+		std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+		if (threadSafe) lock.lock();
+
+		if (!freeList) grow();
+
+		buffer = freeList;
+		freeList = buffer->nextFree;
+
+		++buffersInUse;
+		if (buffersInUse > highWaterMark) highWaterMark = buffersInUse;
+	}
+
+	buffer->refCount = 1;
+	buffer->nextFree = nullptr;
+	return buffer;
+}
+
+void BufferPool::release(Buffer *buffer) noexcept {
+	if (!buffer->pooled) {
+		buffer->~Buffer();
+		::operator delete(buffer);
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+	if (threadSafe) lock.lock();
+
+	buffer->nextFree = freeList;
+	freeList = buffer;
+	--buffersInUse;
+}
+
+void BufferPool::setThreadSafe() noexcept {
+	threadSafe = true;
+}
+
+size_t BufferPool::getBuffersInUse() noexcept {
+	std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+	if (threadSafe) lock.lock();
+
+	return buffersInUse;
+}
+
+size_t BufferPool::getBuffersAllocated() noexcept {
+	std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+	if (threadSafe) lock.lock();
+
+	return buffersAllocated;
+}
+
+size_t BufferPool::getHighWaterMark() noexcept {
+	std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+	if (threadSafe) lock.lock();
+
+	return highWaterMark;
+}
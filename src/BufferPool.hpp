@@ -0,0 +1,197 @@
+/* 
+ * Copyright (C) 2015 Johannes Schwab
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BUFFER_POOL_HPP
+#define BUFFER_POOL_HPP
+
+/** \file */
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+/**
+ * Reference counted storage for the bytes of a Data packet.
+ * Only handled through BufferRef.
+ */
+class Buffer {
+	friend class BufferPool;
+	friend class BufferRef;
+
+	private:
+		size_t refCount; /**< Number of BufferRef pointing to this buffer */
+		size_t capacity; /**< Usable bytes following the header */
+		bool pooled; /**< Whether or not the buffer belongs to the pool */
+		Buffer *nextFree; /**< Next buffer in the free list */
+
+	public:
+		/**
+		 * Gets the bytes of the buffer.
+		 */
+		uint8_t* bytes() noexcept {
+			return reinterpret_cast<uint8_t*>(this + 1);
+		}
+
+		/**
+		 * Gets the number of usable bytes.
+		 */
+		size_t getCapacity() const noexcept {
+			return capacity;
+		}
+};
+
+/**
+ * Slab allocator for fixed size packet buffers.
+ * Buffers up to BufferPool::bufferSize bytes are taken from a free
+ * list and put back once the last BufferRef is gone. Larger buffers
+ * are allocated from the heap.
+ * The pool is only thread safe after setThreadSafe() was called, the
+ * reference counts never are. A buffer may be handed to another thread
+ * as long as only one thread references it at a time.
+ */
+class BufferPool {
+	public:
+		/**
+		 * Capacity of pooled buffers.
+		 * Fits a maximal ethernet frame plus the tox header and
+		 * the headroom for a fragment header.
+		 */
+		static constexpr size_t bufferSize = 4 + 1 + 1500 + 18;
+
+		/**
+		 * Number of buffers allocated at once when the pool runs dry.
+		 */
+		static constexpr size_t buffersPerSlab = 64;
+
+	private:
+		static Buffer *freeList; /**< Unused pooled buffers */
+		static size_t buffersInUse; /**< Pooled buffers currently in use */
+		static size_t buffersAllocated; /**< Pooled buffers owned by the pool */
+		static size_t highWaterMark; /**< Maximum of buffersInUse */
+		static bool threadSafe; /**< Whether or not mutex is used */
+		static std::mutex mutex; /**< Protects the pool if threadSafe */
+
+		/**
+		 * Allocates a new slab and puts its buffers on the free list.
+		 */
+		static void grow();
+
+	public:
+		BufferPool() = delete; /**< Deleted */
+
+		/**
+		 * Gets a buffer with at least len bytes and a reference count of 1.
+		 * Throws std::bad_alloc if no memory is avaible.
+		 */
+		static Buffer* acquire(size_t len);
+
+		/**
+		 * Returns the buffer to the pool or frees it.
+		 * Must only be called once the reference count dropped to 0.
+		 */
+		static void release(Buffer *buffer) noexcept;
+
+		/**
+		 * Protect the pool with a mutex from now on.
+		 * Must be called before a second thread uses the pool.
+		 */
+		static void setThreadSafe() noexcept;
+
+		/**
+		 * Gets the number of pooled buffers currently in use.
+		 */
+		static size_t getBuffersInUse() noexcept;
+
+		/**
+		 * Gets the number of pooled buffers allocated so far.
+		 */
+		static size_t getBuffersAllocated() noexcept;
+
+		/**
+		 * Gets the maximal number of pooled buffers that have been in
+		 * use at the same time.
+		 */
+		static size_t getHighWaterMark() noexcept;
+};
+
+/**
+ * Non atomic reference to a Buffer.
+ */
+class BufferRef {
+	private:
+		Buffer *buffer; /**< Referenced buffer, may be nullptr */
+
+	public:
+		/**
+		 * Creates an empty reference.
+		 */
+		BufferRef() noexcept : buffer(nullptr) {}
+
+		/**
+		 * Acquires a buffer of at least len bytes from the pool.
+		 */
+		explicit BufferRef(size_t len) : buffer(BufferPool::acquire(len)) {}
+
+		BufferRef(const BufferRef &other) noexcept : buffer(other.buffer) {
+			if (buffer) ++buffer->refCount;
+		}
+
+		BufferRef(BufferRef &&other) noexcept : buffer(other.buffer) {
+			other.buffer = nullptr;
+		}
+
+		BufferRef& operator=(BufferRef other) noexcept {
+			Buffer *tmp = buffer;
+			buffer = other.buffer;
+			other.buffer = tmp;
+			return *this;
+		}
+
+		~BufferRef() {
+			if (buffer && --buffer->refCount == 0) BufferPool::release(buffer);
+		}
+
+		/**
+		 * Whether or not no buffer is referenced.
+		 */
+		bool empty() const noexcept {
+			return buffer == nullptr;
+		}
+
+		/**
+		 * Gets the bytes of the referenced buffer.
+		 */
+		uint8_t* get() const noexcept {
+			return buffer->bytes();
+		}
+
+		/**
+		 * Gets the number of references to the buffer, 0 if empty.
+		 */
+		size_t useCount() const noexcept {
+			return buffer ? buffer->refCount : 0;
+		}
+
+		/**
+		 * Gets the capacity of the referenced buffer.
+		 */
+		size_t getCapacity() const noexcept {
+			return buffer ? buffer->getCapacity() : 0;
+		}
+};
+
+#endif //BUFFER_POOL_HPP
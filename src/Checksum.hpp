@@ -0,0 +1,61 @@
+/* 
+ * Copyright (C) 2015 Johannes Schwab
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CHECKSUM_HPP
+#define CHECKSUM_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+/** \file */
+
+/**
+ * Helper functions for the internet checksum (RFC 1071)
+ */
+namespace Checksum {
+	/**
+	 * Adds buffer to the internet checksum sum.
+	 * \sa finish()
+	 */
+	inline uint32_t add(const uint8_t *buffer, size_t len, uint32_t sum = 0) noexcept {
+		for (size_t i = 0; i + 1 < len; i += 2)
+			sum += static_cast<uint16_t>(buffer[i]) << 8 | buffer[i + 1];
+
+		if (len % 2) sum += static_cast<uint16_t>(buffer[len - 1]) << 8;
+
+		return sum;
+	}
+
+	/**
+	 * Folds sum into the internet checksum.
+	 * \sa add()
+	 */
+	inline uint16_t finish(uint32_t sum) noexcept {
+		while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+
+		return ~sum & 0xFFFF;
+	}
+
+	/**
+	 * Writes the internet checksum in network byte order to pos.
+	 */
+	inline void write(uint8_t *pos, uint16_t checksum) noexcept {
+		pos[0] = checksum >> 8;
+		pos[1] = checksum & 0xFF;
+	}
+} //namespace Checksum
+
+#endif //CHECKSUM_HPP
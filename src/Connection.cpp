@@ -16,29 +16,83 @@
  */
 
 #include "Connection.hpp"
+#include "PacketType.hpp"
 #include "ToxTunCore.hpp"
 #include "Logger.hpp"
 #include "Data.hpp"
 
+#include <algorithm>
 #include <cstring>
+#include <new>
 
-Connection::Connection(uint32_t friendNumber, ToxTunCore &toxTunCore, bool initiateConnection)
+/**
+ * Capabilities supported by this version.
+ */
+static constexpr uint8_t ownCapabilities = Connection::CapabilityMtu;
+
+/**
+ * Capabilities supported by this version, but not towards hubs.
+ */
+static constexpr uint8_t ownPeerCapabilities =
+	Connection::CapabilityHubClient | Connection::CapabilitySubnetMap;
+
+/**
+ * Largest MTU whose frames fit into a single tox packet.
+ * Leaves room for the tox header and an ethernet header with VLAN tag.
+ */
+static constexpr uint16_t maxMtu = TOX_MAX_CUSTOM_PACKET_SIZE - 1 - 18;
+
+/**
+ * Largest MTU whose packets fit into a single tox packet in layer 3 mode.
+ */
+static constexpr uint16_t maxMtuLayer3 = TOX_MAX_CUSTOM_PACKET_SIZE - 1;
+
+/**
+ * Smallest MTU accepted from friend.
+ * Linux disables IPv6 on interfaces with a smaller MTU.
+ */
+static constexpr uint16_t minMtu = 1280;
+
+Connection::Connection(
+		uint32_t friendNumber,
+		ToxTunCore &toxTunCore,
+		bool initiateConnection,
+		uint8_t peerCapabilities
+)
 :
 	toxTunCore(toxTunCore),
-	tun(toxTunCore.getTox()),
+	tun(nullptr),
 	state(
 			initiateConnection ?
 			State::OwnRequestPending : State::FriendsRequestPending
 	),
+	fragments(toxTunCore.getReassemblyBudget()),
 	connectedFriend(friendNumber),
 	nextFragmentIndex(0),
-	subnet(-1)
+	subnet(-1),
+	peerCapabilities(initiateConnection ? 0 : peerCapabilities),
+	mtu(0),
+	mtuApplied(false),
+	layer3(false),
+	flushScheduled(false),
+	hub(toxTunCore.getHubMode()),
+	ownFreeSubnets(),
+	subnetMapSent(false),
+	hubPostfix(0)
 {
-	if (initiateConnection)
-		sendConnectionRequest();
+	if (initiateConnection) sendConnectionRequest();
 }
 
 Connection::~Connection() {
+	if (ownTun) {
+		toxTunCore.getPoller().remove(*ownTun, connectedFriend);
+		toxTunCore.recycleTun(std::move(ownTun));
+	}
+	if (hub) {
+		toxTunCore.getForwardingTable().remove(connectedFriend);
+		if (hubPostfix) toxTunCore.releaseHubPostfix(hubPostfix);
+	}
+
 	switch (state) {
 		case State::FriendsRequestPending:
 			rejectConnection();
@@ -58,74 +112,113 @@ Connection::~Connection() {
 
 void Connection::rejectConnection() noexcept {
 	Data data(Data::fromPacketId(Data::PacketId::ConnectionReject));
-	try {
-		sendToTox(data);
-	} catch (ToxTunError &error) {}
+	sendToTox(data);
 }
 
 void Connection::closeConnection() noexcept {
 	Data data(Data::fromPacketId(Data::PacketId::ConnectionClose));
-	try {
-		sendToTox(data);
-	} catch (ToxTunError &error) {}
+	sendToTox(data);
 }
 
 void Connection::handleData(const Data &data) noexcept {
-	switch(data.getToxHeader()) {
-		case Data::PacketId::ConnectionRequest:
-			//This should never be reached
-			Logger::error("Connection doesn't handle connection requestes");
-			break;
-		case Data::PacketId::ConnectionAccept:
-			handleConnectionAccepted();
-			break;
-		case Data::PacketId::ConnectionReject:
-			handleConnectionRejected();
-			break;
-		case Data::PacketId::ConnectionClose:
-			handleConnectionClosed();
-			break;
-		case Data::PacketId::ConnectionReset:
-			handleConnectionReset();
-			break;
-		case Data::PacketId::IpProposal:
-			handleIpProposal(data);
-			break;
-		case Data::PacketId::IpAccept:
-			handleIpAccepted();
-			break;
-		case Data::PacketId::IpReject:
-			handleIpRejected();
-			break;
-		case Data::PacketId::Data:
-			sendToTun(data);
-			break;
-		case Data::PacketId::Fragment:
-			handleFragment(data);
-			break;
+	const ToxTun::DropReason reason = PacketType::validate(data);
+	if (reason != ToxTun::DropReason::None) {
+		Logger::debug("Dropping invalid packet from ", connectedFriend);
+		toxTunCore.countDrop(reason);
+		return;
 	}
+
+	const PacketType &type = PacketType::get(data.getToxHeader());
+	(this->*type.handler)(data);
 }
 
-void Connection::iterate(std::chrono::duration<double> time) noexcept {
-	const auto tStart = std::chrono::high_resolution_clock::now();
-	while(true) {
-		if (state != State::Connected || !tun.dataPending()) break;
+void Connection::handleConnectionRequest(const Data &data) noexcept {
+	//This should never be reached
+	Logger::error("Connection doesn't handle connection requestes");
+}
 
-		const auto tNow = std::chrono::high_resolution_clock::now();
-		const auto tElapsed = std::chrono::duration_cast<std::chrono::duration<double>>(
-				tNow - tStart
-		);
-		if (tElapsed > time) break;
+void Connection::iterate(size_t packetBudget, size_t byteBudget) noexcept {
+	if (state == State::Connected)
+		tun->setMssClamp(toxTunCore.getMssClamping() ? mtu : 0);
+
+	size_t packets = 0, bytes = 0;
+	while (state == State::Connected && packets < packetBudget && bytes < byteBudget) {
+		Data data;
+		ToxTun::DropReason reason = tun->getData(data);
+		if (reason == ToxTun::DropReason::None && data.empty()) break;
+
+		++packets;
+		if (!data.empty()) bytes += data.getIpDataLen();
+
+		if (
+				reason == ToxTun::DropReason::None &&
+				data.getToxDataLen() > TOX_MAX_CUSTOM_PACKET_SIZE &&
+				toxTunCore.getPathMtuDiscovery() &&
+				tun->sendPacketTooBig(data, mtu)
+		) {
+			reason = ToxTun::DropReason::IcmpTooBig;
+		}
+		if (reason != ToxTun::DropReason::None) {
+			toxTunCore.countDrop(reason);
+			continue;
+		}
 
-		try {
-			sendToTox(tun.getData());
-		} catch (ToxTunError &error) {}
+		sendFrame(data);
 	}
 }
 
+void Connection::sendFrame(const Data &data) noexcept {
+	const ToxTun::DropReason reason = sendToTox(data);
+	if (reason != ToxTun::DropReason::None) toxTunCore.countDrop(reason);
+}
+
+uint8_t Connection::getOwnCapabilities() const noexcept {
+	uint8_t capabilities = ownCapabilities;
+	if (hub) return capabilities | CapabilityHub;
+
+	capabilities |= ownPeerCapabilities;
+	if (Tun::layer3Supported && toxTunCore.getTunOptions().layer3)
+		capabilities |= CapabilityLayer3;
+
+	return capabilities;
+}
+
+uint16_t Connection::getMaxMtu() const noexcept {
+	return layer3 ? maxMtuLayer3 : maxMtu;
+}
+
+uint16_t Connection::agreeMtu(uint16_t peerMtu) const noexcept {
+	//Legacy friends don't send a MTU and expect the old default
+	if (!peerMtu) return getMaxMtu();
+
+	if (peerMtu < minMtu) {
+		Logger::error("Friend ", connectedFriend, " sent MTU ", peerMtu, ", below the minimum of ", minMtu);
+		return 0;
+	}
+
+	return std::min(peerMtu, getMaxMtu());
+}
+
+void Connection::createTun() {
+	layer3 = (getOwnCapabilities() & peerCapabilities & CapabilityLayer3) != 0;
+
+	if (hub) {
+		tun = &toxTunCore.getHubTun(maxMtu);
+		return;
+	}
+
+	TunInterface::Options options = toxTunCore.getTunOptions();
+	options.layer3 = layer3;
+	ownTun = toxTunCore.createTun(options);
+	ownTun->setTrafficFilter(&toxTunCore.getTrafficFilter());
+	tun = ownTun.get();
+}
+
 void Connection::sendConnectionRequest() {
-	Data data(Data::fromPacketId(Data::PacketId::ConnectionRequest));
-	sendToTox(data);
+	Data data(Data::fromCapabilities(Data::PacketId::ConnectionRequest, getOwnCapabilities()));
+	if (sendToTox(data) != ToxTun::DropReason::None) {
+		throw ToxTunError(Logger::concat("Can't send connectionRequest to ", connectedFriend));
+	}
 	Logger::debug("Send connectionRequest to ", connectedFriend);
 }
 
@@ -145,26 +238,46 @@ void Connection::resetAndDeleteConnection() noexcept {
 
 void Connection::resetConnection(uint32_t friendNumber, Tox *tox) noexcept {
 	Data data(Data::fromPacketId(Data::PacketId::ConnectionReset));
-	try {
-		sendToTox(data, friendNumber, tox);
-	} catch (ToxTunError &error) {}
+	sendToTox(data, friendNumber, tox);
 
 	Logger::debug("Reset connection to ", friendNumber);
 }
 
-void Connection::handleConnectionAccepted() noexcept {
+void Connection::handleConnectionAccepted(const Data &data) noexcept {
 	if (state != State::OwnRequestPending) {
 		Logger::debug("Unexpected connectionAccepted received from ", connectedFriend);
 		resetAndDeleteConnection();
 		return;
 	}
 
+	peerCapabilities = data.getCapabilities();
+
+	try {
+		createTun();
+	} catch (ToxTunError &error) {
+		Logger::error("Can't create tun interface for ", connectedFriend, ": ", error.what());
+		resetAndDeleteConnection();
+		return;
+	}
+
+	if (!hub && (peerCapabilities & CapabilityHub)) {
+		Logger::debug("Waiting for Ip assigned by hub ", connectedFriend);
+		state = State::ExpectingIpPacket;
+		return;
+	}
+
+	if (getOwnCapabilities() & peerCapabilities & CapabilitySubnetMap) {
+		Logger::debug("Waiting for free subnets of ", connectedFriend);
+		state = State::ExpectingIpPacket;
+		return;
+	}
+
 	Logger::debug("Start to negotiate Ip with friend ", connectedFriend);
 	state = State::ExpectingIpConfirmation;
 	sendIp();
 }
 
-void Connection::handleConnectionRejected() noexcept {
+void Connection::handleConnectionRejected(const Data &data) noexcept {
 	if (state != State::OwnRequestPending) {
 		Logger::debug("Unexpected connectionReject received from ", connectedFriend);
 		resetAndDeleteConnection();
@@ -180,7 +293,7 @@ void Connection::handleConnectionRejected() noexcept {
 	deleteConnection();
 }
 
-void Connection::handleConnectionClosed() noexcept {
+void Connection::handleConnectionClosed(const Data &data) noexcept {
 	if (state != State::Connected) {
 		Logger::debug("Received connectionClose from ", connectedFriend);
 		resetAndDeleteConnection();
@@ -196,7 +309,7 @@ void Connection::handleConnectionClosed() noexcept {
 	deleteConnection();
 }
 
-void Connection::handleConnectionReset() noexcept {
+void Connection::handleConnectionReset(const Data &data) noexcept {
 	Logger::debug("ConnectionReset received from ", connectedFriend);
 
 	toxTunCore.callback(
@@ -213,6 +326,19 @@ void Connection::handleIpProposal(const Data &data) noexcept {
 		return;
 	}
 
+	if (hub) {
+		Logger::error("Friend ", connectedFriend, " doesn't support hubs, it has to be called by the hub");
+		resetAndDeleteConnection();
+		return;
+	}
+
+	const uint16_t proposedMtu = data.getMtu();
+	const uint16_t agreedMtu = agreeMtu(proposedMtu);
+	if (!agreedMtu) {
+		resetAndDeleteConnection();
+		return;
+	}
+
 	uint8_t postfix, subnet;
 	try {
 		postfix = data.getIpPostfix();
@@ -224,7 +350,7 @@ void Connection::handleIpProposal(const Data &data) noexcept {
 
 	bool unused;
 	try {
-		unused = tun.isAddrspaceUnused(subnet);
+		unused = tun->isAddrspaceUnused(subnet);
 	} catch (ToxTunError &error) {
 		Logger::error("Can't check if subnet is used, assuming it is not");
 		unused = true;
@@ -232,74 +358,184 @@ void Connection::handleIpProposal(const Data &data) noexcept {
 
 	if (unused) {
 		Logger::debug("Address space ", static_cast<int>(subnet), " unused");
-		Data data = Data::fromPacketId(Data::PacketId::IpAccept);
-		try {
-			sendToTox(data);
-		} catch (ToxTunError &error) {
+		Data data = proposedMtu ?
+			Data::fromMtu(agreedMtu) :
+			Data::fromPacketId(Data::PacketId::IpAccept);
+		if (sendToTox(data) != ToxTun::DropReason::None) {
 			resetAndDeleteConnection();
+			return;
 		}
+		mtu = agreedMtu;
 		setIp(subnet, postfix);
 	} else {
 		Logger::debug("Address space ", static_cast<int>(subnet), " used");
 		Data data = Data::fromPacketId(Data::PacketId::IpReject);
-		try {
-			sendToTox(data);
-		} catch (ToxTunError &error) {
+		if (sendToTox(data) != ToxTun::DropReason::None) {
 			resetAndDeleteConnection();
 		}
 	}
 }
 
 void Connection::setIp(uint8_t subnet, uint8_t postfix) noexcept {
-	try {
-		tun.setIp(subnet, postfix);
-		Logger::debug("Ip set to 192.168.",
-				static_cast<int>(subnet), ".",
-				static_cast<int>(postfix)
-		);
-	} catch (ToxTunError &error) {
-		Logger::error(
-				"Can't set Ip to 192.168.",
-				static_cast<int>(subnet), ".",
-				static_cast<int>(postfix)
+	if (hub) {
+		const uint8_t peerIp[4] = {192, 168, subnet, hubPostfix};
+		toxTunCore.getForwardingTable().addIp4(peerIp, connectedFriend);
+		mtuApplied = toxTunCore.isHubMtuApplied();
+
+		state = State::Connected;
+		toxTunCore.callback(
+				ToxTun::Event::ConnectionAccepted,
+				connectedFriend
 		);
 		return;
 	}
 
+	mtuApplied = tun->configure(subnet, postfix, mtu);
+	Logger::debug("Ip set to 192.168.",
+			static_cast<int>(subnet), ".",
+			static_cast<int>(postfix)
+	);
+
+	//Friend has the other one of the two addresses
+	tun->setPeerIp(subnet, postfix == 1 ? 2 : 1);
+
+	if (!mtuApplied) {
+		Logger::error("Can't set MTU, frames bigger than a tox packet will be fragmented");
+	}
+
 	state = State::Connected;
+	toxTunCore.getPoller().add(*tun, connectedFriend);
 	toxTunCore.callback(
 			ToxTun::Event::ConnectionAccepted,
 			connectedFriend
 	);
 }
 
-void Connection::handleIpAccepted() noexcept {
+void Connection::handleIpAccepted(const Data &data) noexcept {
 	if (state != State::ExpectingIpConfirmation) {
 		Logger::debug("Received unexpected IpAccept from ", connectedFriend);
 		resetAndDeleteConnection();
 		return;
 	}
 
+	mtu = agreeMtu(data.getMtu());
+	if (!mtu) {
+		resetAndDeleteConnection();
+		return;
+	}
+
 	setIp(subnet, 1);
 }
 
-void Connection::handleIpRejected() noexcept {
+void Connection::handleIpRejected(const Data &data) noexcept {
 	if (state != State::ExpectingIpConfirmation) {
 		Logger::debug("Received unexpected IpReject from ", connectedFriend);
 		resetAndDeleteConnection();
 		return;
 	}
 
+	if (hub) {
+		Logger::error("Friend ", connectedFriend, " can't use the hub subnet");
+		resetAndDeleteConnection();
+		return;
+	}
+
 	sendIp();
 }
 
+bool Connection::sendSubnetMap() noexcept {
+	for (size_t subnet = 0; subnet < 256; ++subnet) {
+		bool unused;
+		try {
+			unused = tun->isAddrspaceUnused(subnet);
+		} catch (ToxTunError &error) {
+			Logger::error("Can't check if subnet is used, assuming it is not");
+			unused = true;
+		}
+
+		if (unused) ownFreeSubnets[subnet / 8] |= 1 << (subnet % 8);
+	}
+
+	Data data;
+	try {
+		data = Data::fromSubnetMap(ownFreeSubnets, getMaxMtu());
+	} catch (std::bad_alloc &error) {
+		Logger::error("Can't allocate memory for subnet map");
+		resetAndDeleteConnection();
+		return false;
+	}
+
+	if (sendToTox(data) != ToxTun::DropReason::None) {
+		resetAndDeleteConnection();
+		return false;
+	}
+
+	subnetMapSent = true;
+	return true;
+}
+
+void Connection::handleSubnetMap(const Data &data) noexcept {
+	if (
+			state != State::ExpectingIpPacket ||
+			!(getOwnCapabilities() & peerCapabilities & CapabilitySubnetMap)
+	) {
+		Logger::debug("Received unexpected SubnetMap from ", connectedFriend);
+		resetAndDeleteConnection();
+		return;
+	}
+
+	//The friend who accepted the connection sent its map first
+	const bool initiator = !subnetMapSent;
+	if (initiator && !sendSubnetMap()) return;
+
+	//Both sides pick the lowest subnet free on both of them
+	const std::array<uint8_t, 32> peerFreeSubnets = data.getSubnetMap();
+	for (subnet = 0; subnet < 256; ++subnet) {
+		const uint8_t bit = 1 << (subnet % 8);
+		if (ownFreeSubnets[subnet / 8] & peerFreeSubnets[subnet / 8] & bit) break;
+	}
+
+	if (subnet == 256) {
+		Logger::error("No Ip subnet free on both sides");
+		resetAndDeleteConnection();
+		return;
+	}
+
+	mtu = agreeMtu(data.getMtu());
+	if (!mtu) {
+		resetAndDeleteConnection();
+		return;
+	}
+
+	Logger::debug("Subnet ", subnet, " is free on both sides");
+	setIp(subnet, initiator ? 1 : 2);
+}
+
 void Connection::sendIp() noexcept {
+	const uint16_t proposedMtu = (peerCapabilities & CapabilityMtu) ? getMaxMtu() : 0;
+
+	if (hub) {
+		hubPostfix = toxTunCore.allocateHubPostfix();
+		if (!hubPostfix) {
+			Logger::error("No free Ip in hub subnet avaible");
+			resetAndDeleteConnection();
+			return;
+		}
+
+		subnet = toxTunCore.getHubSubnet();
+		Data data = Data::fromIpPostfix(subnet, hubPostfix, proposedMtu);
+		if (sendToTox(data) != ToxTun::DropReason::None) {
+			resetAndDeleteConnection();
+		}
+		return;
+	}
+
 	bool unused = false;
 	while (!unused) {
 		++subnet;
 
 		try {
-			unused = tun.isAddrspaceUnused(subnet);
+			unused = tun->isAddrspaceUnused(subnet);
 		} catch (ToxTunError &error) {
 			Logger::error("Can't check if subnet is used, assuming it is not");
 			unused = true;
@@ -312,34 +548,60 @@ void Connection::sendIp() noexcept {
 		}
 	}
 
-	Data data = Data::fromIpPostfix(subnet, 2);
-	try {
-		sendToTox(data);
-	} catch (ToxTunError &error) {
+	Data data = Data::fromIpPostfix(subnet, 2, proposedMtu);
+	if (sendToTox(data) != ToxTun::DropReason::None) {
 		resetAndDeleteConnection();
 	}
 }
 
 void Connection::sendToTun(const Data &data) noexcept {
 	if (state != State::Connected) {
-		Logger::error("Received data package from not connected friend");
+		Logger::debug("Received data package from not connected friend");
+		toxTunCore.countDrop(ToxTun::DropReason::NotConnected);
 		resetAndDeleteConnection();
+		return;
+	}
+
+	if (hub && !toxTunCore.getForwardingTable().learn(data, connectedFriend)) {
+		toxTunCore.countDrop(ToxTun::DropReason::SpoofedSource);
+		return;
+	}
+
+	const ToxTun::DropReason reason = tun->sendData(data);
+	if (reason != ToxTun::DropReason::None) toxTunCore.countDrop(reason);
+
+	if (!flushScheduled) {
+		try {
+			toxTunCore.scheduleFlush(connectedFriend);
+			flushScheduled = true;
+		} catch (std::bad_alloc &error) {
+			flushTun();
+		}
 	}
-	try {
-		tun.sendData(data);
-	} catch (ToxTunError &error) {};
 }
 
-void Connection::sendToTox(const Data &data) {
-	sendToTox(data, connectedFriend, toxTunCore.getTox(), &nextFragmentIndex);
+bool Connection::hasPendingFrames() const noexcept {
+	return !hub && state == State::Connected && tun && tun->hasPending();
 }
 
-void Connection::sendToTox(const Data &data, uint32_t friendNumber, Tox *tox, uint8_t *nextFragmentIndex){
-	std::forward_list<Data> dataList;
+void Connection::flushTun() noexcept {
+	flushScheduled = false;
 
-	if (data.getToxDataLen() <= TOX_MAX_CUSTOM_PACKET_SIZE) {
-		dataList.push_front(data);
-	} else {
+	const ToxTun::DropReason reason = tun->flush();
+	if (reason != ToxTun::DropReason::None) toxTunCore.countDrop(reason);
+}
+
+ToxTun::DropReason Connection::sendToTox(const Data &data) noexcept {
+	return sendToTox(data, connectedFriend, toxTunCore.getTox(), &nextFragmentIndex);
+}
+
+ToxTun::DropReason Connection::sendToTox(
+		const Data &data,
+		uint32_t friendNumber,
+		Tox *tox,
+		uint8_t *nextFragmentIndex
+) noexcept {
+	if (data.getToxDataLen() > TOX_MAX_CUSTOM_PACKET_SIZE) {
 		Logger::debug("Packet to big for tox, splitting it");
 		uint8_t index = 0;
 		if (nextFragmentIndex) {
@@ -347,42 +609,67 @@ void Connection::sendToTox(const Data &data, uint32_t friendNumber, Tox *tox, ui
 			*nextFragmentIndex = (*nextFragmentIndex == 255) ?
 				0 : *nextFragmentIndex + 1;
 		}
-		dataList = std::move(data.getSplitted(index));
+
+		const std::vector<Data::Fragment> fragments = data.getSplitted(index);
+		if (fragments.empty()) return ToxTun::DropReason::PacketTooBig;
+
+		for (const auto &f : fragments) {
+			const bool status = data.sendFragment(
+					f,
+					[tox, friendNumber](const uint8_t *buffer, size_t len) {
+						return tox_friend_send_lossy_packet(
+								tox,
+								friendNumber,
+								buffer,
+								len,
+								NULL
+						);
+					}
+			);
+
+			if (!status) {
+				Logger::debug("Can't send fragment to ", friendNumber);
+				return ToxTun::DropReason::ToxSendError;
+			}
+		}
+		return ToxTun::DropReason::None;
 	}
 
 	bool status;
-	for (const auto &d : dataList) {
-		switch (d.getSendTox()) {
-			case Data::SendTox::Lossless:
-				Logger::debug("Sending lossless packet to ", friendNumber);
-				status = tox_friend_send_lossless_packet(
-						tox,
-						friendNumber,
-						d.getToxData(),
-						d.getToxDataLen(),
-						NULL
-				);
-
-				if (!status) {
-					throw ToxTunError(Logger::concat("Can't send lossless packet to ", friendNumber));
-				}
-				break;
-			case Data::SendTox::Lossy:
-				Logger::debug("Sending lossy packet to ", friendNumber);
-				status = tox_friend_send_lossy_packet(
-						tox,
-						friendNumber,
-						d.getToxData(),
-						d.getToxDataLen(),
-						NULL
-				);
-
-				if (!status) {
-					throw ToxTunError(Logger::concat("Can't send lossy packet to ", friendNumber));
-				}
-				break;
-		}
+	switch (data.getSendTox()) {
+		case Data::SendTox::Lossless:
+			Logger::debug("Sending lossless packet to ", friendNumber);
+			status = tox_friend_send_lossless_packet(
+					tox,
+					friendNumber,
+					data.getToxData(),
+					data.getToxDataLen(),
+					NULL
+			);
+
+			if (!status) {
+				Logger::debug("Can't send lossless packet to ", friendNumber);
+				return ToxTun::DropReason::ToxSendError;
+			}
+			break;
+		case Data::SendTox::Lossy:
+			Logger::debug("Sending lossy packet to ", friendNumber);
+			status = tox_friend_send_lossy_packet(
+					tox,
+					friendNumber,
+					data.getToxData(),
+					data.getToxDataLen(),
+					NULL
+			);
+
+			if (!status) {
+				Logger::debug("Can't send lossy packet to ", friendNumber);
+				return ToxTun::DropReason::ToxSendError;
+			}
+			break;
 	}
+
+	return ToxTun::DropReason::None;
 }
 
 void Connection::acceptConnection() {
@@ -390,17 +677,24 @@ void Connection::acceptConnection() {
 		throw ToxTunError("Connection not on right state to accept connection request");
 	}
 
+	//Requests that are never accepted don't cost a tun interface
+	createTun();
 	state = State::ExpectingIpPacket;
 
-	Data data(Data::fromPacketId(Data::PacketId::ConnectionAccept));
-	try {
-		sendToTox(data);
-	} catch (ToxTunError &error) {
+	Data data(Data::fromCapabilities(Data::PacketId::ConnectionAccept, getOwnCapabilities()));
+	if (sendToTox(data) != ToxTun::DropReason::None) {
 		resetAndDeleteConnection();
 		return;
 	}
 
 	Logger::debug("Accepting connection from ", connectedFriend);
+
+	if (hub && (peerCapabilities & CapabilityHubClient)) {
+		state = State::ExpectingIpConfirmation;
+		sendIp();
+	} else if (getOwnCapabilities() & peerCapabilities & CapabilitySubnetMap) {
+		sendSubnetMap();
+	}
 }
 
 void Connection::deleteConnection() noexcept {
@@ -409,27 +703,27 @@ void Connection::deleteConnection() noexcept {
 }
 
 void Connection::handleFragment(const Data &data) noexcept {
-	if (!data.isValidFragment()) return;
+	if (!data.isValidFragment()) {
+		toxTunCore.countDrop(ToxTun::DropReason::InvalidFragment);
+		return;
+	}
 
 	const uint8_t sdi = data.getSplittedDataIndex();
 
-	if (!fragments.count(sdi)) {
-		std::list<Data> l = {data};
-		fragments.emplace(sdi, std::move(l));
-	} else {
-		fragments.at(sdi).push_front(data);
+	bool complete;
+	const ToxTun::DropReason reason = fragments.insert(data, complete);
+	if (reason != ToxTun::DropReason::None) {
+		toxTunCore.countDrop(reason);
+		return;
 	}
 
-	if (fragments.at(sdi).size() == data.getFragmentsCount()) {
-		std::list<Data> tmp(std::move(fragments.at(sdi)));
-		fragments.erase(sdi);
+	if (complete) {
+		Data packet(fragments.take(sdi));
 
 		for (size_t i=sdi+128u;i<sdi+128u+3u;++i)
-			fragments.erase(i%256);
-
-		handleData(Data::fromFragments(tmp));
+			fragments.clear(i%256);
 
-		Logger::debug("fragments[", connectedFriend, "].size() == ", fragments.size());
+		handleData(packet);
 	}
 }
 
@@ -454,3 +748,15 @@ ToxTun::ConnectionState Connection::getConnectionState() noexcept {
 			break;
 	}
 }
+
+ToxTun::ConnectionStatistics Connection::getConnectionStatistics() const noexcept {
+	ToxTun::ConnectionStatistics statistics = {};
+
+	if (state == State::Connected) {
+		statistics.mtu = mtu;
+		statistics.mtuApplied = mtuApplied;
+		statistics.layer3 = layer3;
+	}
+
+	return statistics;
+}
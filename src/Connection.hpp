@@ -20,14 +20,15 @@
 
 /** \file */
 
+#include "Data.hpp"
+#include "Reassembly.hpp"
 #include "Tun.hpp"
 #include "ToxTun.hpp"
 
-#include <list>
-#include <map>
-#include <chrono>
+#include <array>
+#include <cstddef>
+#include <memory>
 
-class Data;
 class Tox;
 class ToxTunCore;
 
@@ -36,6 +37,8 @@ class ToxTunCore;
  * All public functions (except the constructor) should not throw an exception.
  */
 class Connection {
+	friend struct PacketTypeTable;
+
 	private:
 		/**
 		 * Possible states
@@ -51,13 +54,23 @@ class Connection {
 		};
 
 		ToxTunCore &toxTunCore; /**< ToxTunCore */
-		Tun tun; /**< Tun interface */
+		/**
+		 * Tun interface owned by this connection.
+		 * Created once the connection is accepted, nullptr before and
+		 * in hub mode.
+		 */
+		std::unique_ptr<Tun> ownTun;
+		/**
+		 * Tun interface used, either ownTun or the hub tun interface of
+		 * ToxTunCore. nullptr before it is created.
+		 */
+		Tun *tun;
 		State state; /**< Current state */
 
 		/**
 		 * Fragments of jet incomplete received packages.
 		 */
-		std::map<uint8_t, std::list<Data> > fragments;
+		Reassembly fragments;
 
 		/**
 		 * Friend this connected is to.
@@ -75,6 +88,54 @@ class Connection {
 		 */
 		int16_t subnet;
 
+		/**
+		 * Capabilities announced by friend.
+		 */
+		uint8_t peerCapabilities;
+
+		/**
+		 * MTU agreed with friend.
+		 * 0 if not negotiated yet.
+		 */
+		uint16_t mtu;
+
+		/**
+		 * Whether or not mtu is set on the tun interface.
+		 */
+		bool mtuApplied;
+
+		/**
+		 * Whether or not IP packets are exchanged without ethernet header.
+		 */
+		bool layer3;
+
+		/**
+		 * Whether or not ToxTunCore will call flushTun().
+		 */
+		bool flushScheduled;
+
+		/**
+		 * Whether or not this side is the hub and assigns the address.
+		 */
+		const bool hub;
+
+		/**
+		 * Free subnets sent to friend in a SubnetMap.
+		 * \sa sendSubnetMap()
+		 */
+		std::array<uint8_t, 32> ownFreeSubnets;
+
+		/**
+		 * Whether or not ownFreeSubnets was sent to friend.
+		 */
+		bool subnetMapSent;
+
+		/**
+		 * Address assigned to friend in the hub subnet.
+		 * 0 if none is assigned.
+		 */
+		uint8_t hubPostfix;
+
 		/**
 		 * Called by handleData
 		 * \sa handleData
@@ -85,31 +146,31 @@ class Connection {
 		 * Called by handleData
 		 * \sa handleData
 		 */
-		void handleConnectionRequest();
+		void handleConnectionRequest(const Data &data) noexcept;
 
 		/**
 		 * Called by handleData
 		 * \sa handleData
 		 */
-		void handleConnectionAccepted() noexcept;
+		void handleConnectionAccepted(const Data &data) noexcept;
 
 		/**
 		 * Called by handleData
 		 * \sa handleData
 		 */
-		void handleConnectionRejected() noexcept;
+		void handleConnectionRejected(const Data &data) noexcept;
 
 		/**
 		 * Called by handleData
 		 * \sa handleData
 		 */
-		void handleConnectionClosed() noexcept;
+		void handleConnectionClosed(const Data &data) noexcept;
 
 		/**
 		 * Called by handleData
 		 * \sa handleData
 		 */
-		void handleConnectionReset() noexcept;
+		void handleConnectionReset(const Data &data) noexcept;
 
 		/**
 		 * Called by handleData
@@ -122,13 +183,19 @@ class Connection {
 		 * Called by handleData
 		 * \sa handleData
 		 */
-		void handleIpAccepted() noexcept;
+		void handleIpAccepted(const Data &data) noexcept;
 
 		/**
 		 * Called by handleData
 		 * \sa handleData
 		 */
-		void handleIpRejected() noexcept;
+		void handleIpRejected(const Data &data) noexcept;
+
+		/**
+		 * Called by handleData
+		 * \sa handleData
+		 */
+		void handleSubnetMap(const Data &data) noexcept;
 
 		/**
 		 * Reset the connection without deleting it
@@ -142,6 +209,29 @@ class Connection {
 		 */
 		void resetAndDeleteConnection() noexcept;
 
+		/**
+		 * Gets the capabilities announced to friend.
+		 */
+		uint8_t getOwnCapabilities() const noexcept;
+
+		/**
+		 * Gets the largest MTU whose packets fit into a single tox packet.
+		 */
+		uint16_t getMaxMtu() const noexcept;
+
+		/**
+		 * Gets the MTU to use with the MTU sent by friend.
+		 * \param[in] peerMtu MTU sent by friend, 0 if it didn't send one
+		 * \return 0 if peerMtu is too small to be used
+		 */
+		uint16_t agreeMtu(uint16_t peerMtu) const noexcept;
+
+		/**
+		 * Create the tun interface in the mode both sides support.
+		 * Throws ToxTunError if it can't be created.
+		 */
+		void createTun();
+
 		/**
 		 * Send a connection request to the friend
 		 */
@@ -163,7 +253,13 @@ class Connection {
 		void sendIp() noexcept;
 
 		/**
-		 * Set Ip and change state to connected
+		 * Send the free subnets to friend
+		 * \return false if the connection was deleted
+		 */
+		bool sendSubnetMap() noexcept;
+
+		/**
+		 * Set Ip and MTU and change state to connected
 		 */
 		void setIp(uint8_t subnet, uint8_t postfix) noexcept;
 
@@ -179,16 +275,37 @@ class Connection {
 
 		/**
 		 * Send data to friend via Tox
+		 * \return ToxTun::DropReason::None on success
 		 */
-		void sendToTox(const Data &data);
+		ToxTun::DropReason sendToTox(const Data &data) noexcept;
 
 	public:
 		/**
-		 * Creates the tun interface and registers the callback functions
-		 * to tox.
+		 * Optional features announced in ConnectionRequest and
+		 * ConnectionAccept.
+		 */
+		enum Capability : uint8_t {
+			CapabilityMtu = 1 << 0, /**< MTU is negotiated with the Ip */
+			CapabilityLayer3 = 1 << 1, /**< IP packets without ethernet header */
+			CapabilityHubClient = 1 << 2, /**< Waits for the IpProposal of a hub */
+			CapabilityHub = 1 << 3, /**< Sends the IpProposal and assigns the address */
+			CapabilitySubnetMap = 1 << 4 /**< Subnet is chosen from the SubnetMaps of both sides */
+		};
+
+		/**
+		 * Sends the connection request if initiate is true.
+		 * The tun interface is only created once the connection is
+		 * accepted.
 		 * \param[in] tox Pointer to Tox
+		 * \param[in] peerCapabilities Capabilities of the friends
+		 * ConnectionRequest, ignored if initiate is true
 		 */
-		Connection(uint32_t friendNumber, ToxTunCore &toxTunCore, bool initiate);
+		Connection(
+				uint32_t friendNumber,
+				ToxTunCore &toxTunCore,
+				bool initiate,
+				uint8_t peerCapabilities = 0
+		);
 
 		Connection(const Connection&) = delete; /**< Deleted */
 		Connection& operator=(const Connection&) = delete; /**< Deleted */
@@ -201,8 +318,29 @@ class Connection {
 
 		/**
 		 * This is doing the work.
+		 * Sends frames read from the tun interface until there are none
+		 * left or one of the budgets is used up.
+		 * \param[in] packetBudget Maximal number of frames to read
+		 * \param[in] byteBudget Bytes after which no further frame is read
 		 */
-		void iterate(std::chrono::duration<double> time) noexcept;
+		void iterate(size_t packetBudget, size_t byteBudget) noexcept;
+
+		/**
+		 * Writes the frames buffered by the tun interface.
+		 */
+		void flushTun() noexcept;
+
+		/**
+		 * Whether or not iterate() left frames that were already read
+		 * from the tun interface.
+		 */
+		bool hasPendingFrames() const noexcept;
+
+		/**
+		 * Sends a frame read from the tun interface to friend.
+		 * Counts it as dropped if that fails.
+		 */
+		void sendFrame(const Data &data) noexcept;
 
 		/**
 		 * Handles incoming packats
@@ -211,6 +349,7 @@ class Connection {
 
 		/**
 		 * Accepts an priviously received connection request from friend.
+		 * Throws ToxTunError if the tun interface can't be created.
 		 */
 		void acceptConnection();
 
@@ -222,18 +361,24 @@ class Connection {
 
 		/**
 		 * Send data to given friend via tox
+		 * \return ToxTun::DropReason::None on success
 		 */
-		static void sendToTox(
+		static ToxTun::DropReason sendToTox(
 				const Data &data,
 				uint32_t friendNumber,
 				Tox *tox,
 				uint8_t *nextFragmentIndex = nullptr
-		);
+		) noexcept;
 
 		/**
 		 * Get current state of connection to friend.
 		 */
 		ToxTun::ConnectionState getConnectionState() noexcept;
+
+		/**
+		 * Get information about the connection to friend.
+		 */
+		ToxTun::ConnectionStatistics getConnectionStatistics() const noexcept;
 };
 
 #endif //TOX_TUN_CONNECTION_HPP
@@ -17,70 +17,115 @@
 
 #include "Data.hpp"
 #include "Logger.hpp"
+#include "PacketType.hpp"
 #include "ToxTun.hpp"
 
+#include <algorithm>
 #include <tox/tox.h>
 
-Data::Data(size_t len) noexcept
+constexpr size_t Data::headroom;
+constexpr size_t Data::maxFrameLen;
+constexpr size_t Data::inlineSize;
+
+Data::Data(size_t len, size_t headroom)
+:
+	offset(headroom),
+	size(len ? len : 1)
+{
+	if (headroom != 0 || size > inlineSize) {
+		buffer = BufferRef(size + headroom);
+	}
+
+	bytes()[0] = 0;
+}
+
+Data::Data(BufferRef &&buffer, size_t len) noexcept
 :
-	data(std::make_shared<std::vector<uint8_t>>(len ? len : 1)),
-	toxHeaderSet(false)
+	buffer(std::move(buffer)),
+	offset(0),
+	size(len ? len : 1)
 {}
 
-Data Data::fromToxData(const uint8_t *buffer, size_t len) noexcept {
-	Data data(len);
-	memcpy(&(data.data->at(0)), buffer, len);
-	data.toxHeaderSet = true;
+Data::Data() noexcept
+:
+	Data(0)
+{}
 
-	return data;
+bool Data::empty() const noexcept {
+	return size == 1 && bytes()[0] == 0;
 }
 
-Data Data::fromFragments(std::list<Data> &fragments) {
-	size_t len = 0;
-	for (const auto &f : fragments) len += f.data->size() - 4;
+uint8_t* Data::bytes() const noexcept {
+	if (buffer.empty()) return const_cast<uint8_t*>(inlineData);
 
+	return buffer.get() + offset;
+}
+
+Data Data::fromToxData(const uint8_t *buffer, size_t len) {
 	Data data(len);
+	memcpy(data.bytes(), buffer, len);
 
-	fragments.sort(
-			[](const Data &d1, const Data &d2) {
-				return (d1.data->at(2) < d2.data->at(2));
-			}
-	);
-
-	size_t pos = 0;
-	size_t i = 0;
-	for (const auto &f : fragments) {
-		if (i != f.data->at(2)) {
-			throw ToxTunError("Fragmented package corrupted");
-		}
-		++i;
-
-		memcpy(&data.data->at(pos), &f.data->at(4), f.data->size() - 4);
-		pos += f.data->size() - 4;
-	}
+	return data;
+}
+
+Data Data::fromReassembled(BufferRef &&buffer, size_t len) noexcept {
+	return Data(std::move(buffer), len);
+}
+
+Data Data::fromTunData(const uint8_t *buffer, size_t len) {
+	Data data(len + 1, headroom);
+	memcpy(data.bytes() + 1, buffer, len);
+	data.setToxHeader(PacketId::Data);
+	
+	return data;
+}
 
-	data.toxHeaderSet = true;
+Data Data::forTunData() {
+	Data data(maxFrameLen + 1, headroom);
+	data.setToxHeader(PacketId::Data);
 
 	return data;
 }
 
-Data Data::fromTunData(const uint8_t *buffer, size_t len) {
-	if (len + 1 == 0) {
-		throw ToxTunError("Data from Tun to long to store in vector");
+uint8_t* Data::getTunBuffer() noexcept {
+	return bytes() + 1;
+}
+
+bool Data::setIpDataLen(size_t len) noexcept {
+	if (offset + len + 1 > buffer.getCapacity()) return false;
+
+	size = len + 1;
+	return true;
+}
+
+Data Data::fromIpPostfix(uint8_t subnet, uint8_t postfix, uint16_t mtu) noexcept {
+	Data data(mtu ? 5 : 3);
+	data.bytes()[1] = subnet;
+	data.bytes()[2] = postfix;
+	if (mtu) {
+		data.bytes()[3] = mtu >> 8;
+		data.bytes()[4] = mtu & 0xFF;
 	}
+	data.setToxHeader(PacketId::IpProposal);
 
-	Data data(len + 1);
-	memcpy(&(data.data->at(1)), buffer, len);
-	data.setToxHeader(PacketId::Data);
-	
 	return data;
 }
 
-Data Data::fromIpPostfix(uint8_t subnet, uint8_t postfix) noexcept {
+Data Data::fromMtu(uint16_t mtu) noexcept {
 	Data data(3);
-	data.data->at(1) = subnet;
-	data.data->at(2) = postfix;
-	data.setToxHeader(PacketId::IpProposal);
+	data.bytes()[1] = mtu >> 8;
+	data.bytes()[2] = mtu & 0xFF;
+	data.setToxHeader(PacketId::IpAccept);
+
+	return data;
+}
+
+Data Data::fromSubnetMap(const std::array<uint8_t, 32> &freeSubnets, uint16_t mtu) {
+	Data data(1 + 32 + 2);
+	std::copy(freeSubnets.begin(), freeSubnets.end(), data.bytes() + 1);
+	data.bytes()[33] = mtu >> 8;
+	data.bytes()[34] = mtu & 0xFF;
+	data.setToxHeader(PacketId::SubnetMap);
 
 	return data;
 }
@@ -92,43 +137,36 @@ Data Data::fromPacketId(PacketId id) noexcept {
 	return data;
 }
 
+Data Data::fromCapabilities(PacketId id, uint8_t capabilities) noexcept {
+	Data data(2);
+	data.bytes()[1] = capabilities;
+	data.setToxHeader(id);
+
+	return data;
+}
+
 void Data::setToxHeader(PacketId id) noexcept {
-	data->at(0) = static_cast<uint8_t>(id);
-	toxHeaderSet = true;
+	bytes()[0] = static_cast<uint8_t>(id);
 }
 
-Data::PacketId Data::getToxHeader() const {
-	if (!toxHeaderSet) {
-		//This should never happen
-		throw ToxTunError("ToxHeader not set for Data package (1)");
-	}
-	
-	return static_cast<PacketId>(data->at(0));
+Data::PacketId Data::getToxHeader() const noexcept {
+	return static_cast<PacketId>(bytes()[0]);
 }
 	
-const uint8_t* Data::getIpData() const {
-	if (data->size() < 2) {
-		//This should never happen
-		throw ToxTunError("Trying to access IpData in Data packet of length 1");
-	}
-	return &(data->at(1));
+const uint8_t* Data::getIpData() const noexcept {
+	return bytes() + 1;
 }
 
 size_t Data::getIpDataLen() const noexcept {
-	return data->size() - 1;
+	return size - 1;
 }
 
-const uint8_t* Data::getToxData() const {
-	if (!toxHeaderSet) {
-		//This should never happen
-		throw ToxTunError("ToxHeader not set for Data package (2)");
-	}
-	
-	return &(data->at(0));
+const uint8_t* Data::getToxData() const noexcept {
+	return bytes();
 }
 
 size_t Data::getToxDataLen() const noexcept {
-	return data->size();
+	return size;
 }
 
 uint8_t Data::getIpPostfix() const {
@@ -136,11 +174,11 @@ uint8_t Data::getIpPostfix() const {
 		//This should never happen
 		throw ToxTunError("Requesting IP from a non IP Packet");
 	}
-	if (data->size() != 3) {
+	if (size != 3 && size != 5) {
 		throw ToxTunError("Ip Packet has invalid size");
 	}
 
-	return data->at(2);
+	return bytes()[2];
 }
 
 uint8_t Data::getIpSubnet() const {
@@ -148,69 +186,82 @@ uint8_t Data::getIpSubnet() const {
 		//This should never happen
 		throw ToxTunError("Requesting IP from a non IP Packet");
 	}
-	if (data->size() != 3) {
+	if (size != 3 && size != 5) {
 		throw ToxTunError("Ip Packet has invalid size");
 	}
 
-	return data->at(1);
+	return bytes()[1];
 }
 
-std::forward_list<Data> Data::getSplitted(uint8_t splittedDataIndex) const {
-	size_t pos = 0;
-	size_t fragmentIndex = 0;
-	std::forward_list<Data> dataList;
-
-	while (pos < data->size()) {
-		size_t toCpy = (data->size() - pos < TOX_MAX_CUSTOM_PACKET_SIZE - 4) ?
-			data->size() - pos : TOX_MAX_CUSTOM_PACKET_SIZE - 4;
+std::vector<Data::Fragment> Data::getSplitted(uint8_t splittedDataIndex) const {
+	constexpr size_t maxLen = TOX_MAX_CUSTOM_PACKET_SIZE - 4;
+	const size_t count = (size + maxLen - 1) / maxLen;
 
-		if (toCpy + 4 < toCpy) {
-			//This should never happen
-			throw ToxTunError("Integer overflow in getSplitted()");
-		}
+	std::vector<Fragment> fragments;
+	if (count > 255) return fragments;
 
-		Data tmp = Data(toCpy + 4);
-		tmp.setToxHeader(PacketId::Fragment);
-		tmp.data->at(1) = splittedDataIndex;
-		tmp.data->at(2) = fragmentIndex;
-		memcpy(&(tmp.data->at(4)), &(data->at(pos)), toCpy);
+	fragments.reserve(count);
 
-		pos += toCpy;
-		++fragmentIndex;
+	for (size_t pos = 0; pos < size; pos += maxLen) {
+		Fragment f;
+		f.pos = pos;
+		f.len = (size - pos < maxLen) ? size - pos : maxLen;
+		f.header[0] = static_cast<uint8_t>(PacketId::Fragment);
+		f.header[1] = splittedDataIndex;
+		f.header[2] = fragments.size();
+		f.header[3] = count;
 
-		dataList.push_front(std::move(tmp));
+		fragments.push_back(f);
 	}
 
-	for(auto &f : dataList) f.data->at(3) = fragmentIndex;
+	return fragments;
+}
 
-	return dataList;
+Data::SendTox Data::getSendTox() const noexcept {
+	return PacketType::get(getToxHeader()).sendTox;
 }
 
-Data::SendTox Data::getSendTox() const {
-	const uint8_t h = static_cast<uint8_t>(getToxHeader());
-	if (200 <= h && 254 >= h) {
-		return SendTox::Lossy;
-	} else if (160 <= h && 191 >= h) {
-		return SendTox::Lossless;
-	} else {
-		//This should never happen
-		throw ToxTunError("Called getSendTox(), but toxHeader not in range");
+uint8_t Data::getCapabilities() const noexcept {
+	if (size < 2) return 0;
+
+	return bytes()[1];
+}
+
+std::array<uint8_t, 32> Data::getSubnetMap() const noexcept {
+	std::array<uint8_t, 32> freeSubnets;
+	std::copy(bytes() + 1, bytes() + 33, freeSubnets.begin());
+
+	return freeSubnets;
+}
+
+uint16_t Data::getMtu() const noexcept {
+	size_t pos;
+	switch (getToxHeader()) {
+		case PacketId::IpProposal:
+			pos = 3;
+			break;
+		case PacketId::IpAccept:
+			pos = 1;
+			break;
+		case PacketId::SubnetMap:
+			pos = 33;
+			break;
+		default:
+			return 0;
 	}
+
+	if (size < pos + 2) return 0;
+
+	return static_cast<uint16_t>(bytes()[pos]) << 8 | bytes()[pos + 1];
 }
 
 bool Data::isValidFragment() const noexcept {
-	PacketId id;
-	try {
-		id = getToxHeader();
-	} catch (ToxTunError &error) {
-		return false;
-	}
-	if (id != PacketId::Fragment) {
+	if (getToxHeader() != PacketId::Fragment) {
 		Logger::debug("isValidFragment called on non fragment");
 		return false;
 	}
 
-	if (data->size() < 4) {
+	if (size < 4) {
 		Logger::debug("Fragment to short");
 		return false;
 	}
@@ -218,23 +269,14 @@ bool Data::isValidFragment() const noexcept {
 	return true;
 }
 
-uint8_t Data::getSplittedDataIndex() const {
-	if (getToxHeader() != PacketId::Fragment) {
-		//This should never happen
-		throw ToxTunError("Trying to get SplittedDataIndex from a non fragment");
-	}
-	if (data->size() < 2) {
-		throw ToxTunError("Empty Data fragment");
-	}
-	return data->at(1);
+uint8_t Data::getSplittedDataIndex() const noexcept {
+	return bytes()[1];
 }
 
-uint8_t Data::getFragmentsCount() const {
-	if (getToxHeader() != PacketId::Fragment) {
-		throw ToxTunError("Trying to get fragmentsCount from a non fragment");
-	}
-	if (data->size() < 4) {
-		throw ToxTunError("Data fragment to short");
-	}
-	return data->at(3);
+uint8_t Data::getFragmentsCount() const noexcept {
+	return bytes()[3];
+}
+
+uint8_t Data::getFragmentIndex() const noexcept {
+	return bytes()[2];
 }
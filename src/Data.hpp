@@ -20,12 +20,12 @@
 
 /** \file */
 
+#include "BufferPool.hpp"
+
+#include <array>
 #include <cstdint>
 #include <cstring>
-#include <forward_list>
-#include <list>
 #include <vector>
-#include <memory>
 
 /**
  * Class for convenient handling of data to send or receive.
@@ -46,6 +46,7 @@ class Data {
 			IpProposal = 165,
 			IpAccept = 166,
 			IpReject = 167,
+			SubnetMap = 168,
 			Data = 200,
 			Fragment = 201
 		};
@@ -58,48 +59,161 @@ class Data {
 			Lossy
 		};
 
+		/**
+		 * Fragment of a packet too big to be send via tox at once.
+		 * \sa getSplitted()
+		 */
+		struct Fragment {
+			size_t pos; /**< Position of the slice in the tox data */
+			size_t len; /**< Length of the slice */
+			uint8_t header[4]; /**< Header to send in front of the slice */
+		};
+
+		/**
+		 * Packets up to this size are stored inside the class
+		 * instead of a buffer from the BufferPool.
+		 */
+		static constexpr size_t inlineSize = 16;
+
 	private:
 		/**
-		 * The actuall data.
+		 * The actuall data, taken from the BufferPool.
 		 * The first byte is reserved for the tox header.
+		 * Empty if the data is stored in inlineData.
+		 */
+		BufferRef buffer;
+
+		/**
+		 * Storage for packets of at most inlineSize bytes.
+		 * Used instead of buffer to keep control packets away from
+		 * the allocator.
+		 */
+		uint8_t inlineData[inlineSize];
+
+		/**
+		 * Position of the tox header in buffer.
+		 * The bytes in front of it are headroom.
 		 */
-		std::shared_ptr< std::vector<uint8_t> > data;
+		size_t offset;
 
 		/**
-		 * Identifice wether or not the first byte of the data is an 
-		 * valid tox header.
+		 * Number of bytes used in buffer, starting at offset.
 		 */
-		bool toxHeaderSet;
+		size_t size;
 
 		/**
 		 * Private Constructor.
 		 * Use the static members to create an instance.
+		 * Uses inlineData if len fits and no headroom is requested.
+		 * \param[in] len Bytes to use, including the tox header
+		 * \param[in] headroom Bytes to reserve in front of the tox header
+		 * Throws std::bad_alloc if the buffer can't be allocated.
+		 */
+		Data(size_t len, size_t headroom = 0);
+
+		/**
+		 * Private Constructor.
+		 * Takes over a buffer that already contains len bytes
+		 * starting with the tox header.
 		 */
-		Data(size_t len) noexcept ;
+		Data(BufferRef &&buffer, size_t len) noexcept ;
+
+		/**
+		 * Gets the position of the tox header in the buffer.
+		 */
+		uint8_t* bytes() const noexcept;
 
 	public:
+		/**
+		 * Creates an empty packet without a valid tox header.
+		 * Meant to assign another packet to it later on.
+		 */
+		Data() noexcept;
+
+		/**
+		 * Bytes reserved in front of the tox header of packets read
+		 * from the tun interface. Big enough for a fragment header.
+		 */
+		static constexpr size_t headroom = 4;
+
+		/**
+		 * Maximal length of an ethernet frame read from the tun interface.
+		 */
+		static constexpr size_t maxFrameLen = 1500 + 18;
+
+		/**
+		 * Whether or not the packet is empty, e.g. because it was
+		 * created by Data() and nothing was assigned to it.
+		 */
+		bool empty() const noexcept;
+
 		/**
 		 * Create class from data received via Tun interface.
 		 * len must be the size of buffer.
+		 * Throws std::bad_alloc if no memory is avaible.
+		 * \sa forTunData()
 		 */
 		static Data fromTunData(const uint8_t *buffer, size_t len);
 
+		/**
+		 * Create class to read a frame of at most maxFrameLen bytes
+		 * from the Tun interface into.
+		 * The frame has to be written to getTunBuffer() and its length
+		 * set with setIpDataLen() afterwards.
+		 * Sets the header to Data::PacketId::Data.
+		 * Throws std::bad_alloc if no memory is avaible.
+		 */
+		static Data forTunData();
+
+		/**
+		 * Gets the buffer to read a frame from the Tun interface into.
+		 * \sa forTunData()
+		 */
+		uint8_t* getTunBuffer() noexcept;
+
+		/**
+		 * Sets the length of the frame read into getTunBuffer().
+		 * \return false if len is bigger than the buffer
+		 */
+		bool setIpDataLen(size_t len) noexcept;
+
 		/**
 		 * Create class from data received via Tox.
 		 * len must be the size of buffer.
+		 * Throws std::bad_alloc if no memory is avaible.
 		 */
-		static Data fromToxData(const uint8_t *buffer, size_t len) noexcept;
+		static Data fromToxData(const uint8_t *buffer, size_t len);
 
 		/**
-		 * Create class from list of fragments received via Tox
+		 * Create class from a packet reassembled from fragments.
+		 * Takes over the buffer, which must contain the tox header
+		 * followed by len - 1 bytes of data.
+		 * \sa Reassembly
 		 */
-		static Data fromFragments(std::list<Data> &fragments);
+		static Data fromReassembled(BufferRef &&buffer, size_t len) noexcept;
 
 		/**
 		 * Create class from an ip postfix.
-		 * Sets the header to Data::PacketId::IP.
+		 * Sets the header to Data::PacketId::IpProposal.
+		 * \param[in] mtu Proposed MTU, not send if 0
+		 */
+		static Data fromIpPostfix(uint8_t subnet, uint8_t postfix, uint16_t mtu = 0) noexcept;
+
+		/**
+		 * Create class from an accepted MTU.
+		 * Sets the header to Data::PacketId::IpAccept.
 		 */
-		static Data fromIpPostfix(uint8_t subnet, uint8_t postfix) noexcept;
+		static Data fromMtu(uint16_t mtu) noexcept;
+
+		/**
+		 * Create class from the free subnets of the sender.
+		 * Sets the header to Data::PacketId::SubnetMap.
+		 * \param[in] freeSubnets Bit subnet % 8 of byte subnet / 8 is
+		 * set if 192.168.<subnet>.0 is free
+		 * \param[in] mtu Largest MTU the sender supports
+		 * Throws std::bad_alloc if no memory is avaible.
+		 */
+		static Data fromSubnetMap(const std::array<uint8_t, 32> &freeSubnets, uint16_t mtu);
 
 		/**
 		 * Create class from an Data::PacketId.
@@ -107,6 +221,14 @@ class Data {
 		 */
 		static Data fromPacketId(PacketId id) noexcept;
 
+		/**
+		 * Create class from an Data::PacketId followed by the
+		 * capabilities of the sender.
+		 * Used for ConnectionRequest and ConnectionAccept.
+		 * Peers not knowing about capabilities ignore the additional byte.
+		 */
+		static Data fromCapabilities(PacketId id, uint8_t capabilities) noexcept;
+
 		/**
 		 * Changes the header to the given one.
 		 */
@@ -115,13 +237,13 @@ class Data {
 		/**
 		 * Returns the header.
 		 */
-		PacketId getToxHeader() const;
+		PacketId getToxHeader() const noexcept;
 
 		/**
 		 * Gets the data to send via the tun interface.
 		 * This is Data::data without the first byte.
 		 */
-		const uint8_t *getIpData() const;
+		const uint8_t *getIpData() const noexcept;
 
 		/**
 		 * Gets the size of the buffer returned by getIpData().
@@ -132,7 +254,7 @@ class Data {
 		 * Gets the data to send via tox.
 		 * This is the content of Data::data.
 		 */
-		const uint8_t *getToxData() const;
+		const uint8_t *getToxData() const noexcept;
 
 		/**
 		 * Gets the size of the buffer returned by getToxData().
@@ -141,18 +263,37 @@ class Data {
 
 		/**
 		 * Gets the ip postfix of a ip packet received via tox.
-		 * Throws an error, if header isn't Data::PacketId::Ip
+		 * Throws an error, if header isn't Data::PacketId::IpProposal
 		 * or is otherwise invalid.
 		 */
 		uint8_t getIpPostfix() const;
 
 		/**
 		 * Gets the ip subnet of a ip packet received via tox.
-		 * Throws an error, if header isn't Data::PacketId::Ip
+		 * Throws an error, if header isn't Data::PacketId::IpProposal
 		 * or is otherwise invalid.
 		 */
 		uint8_t getIpSubnet() const;
 
+		/**
+		 * Gets the capabilities of a ConnectionRequest or ConnectionAccept.
+		 * \return 0 if the sender didn't send any
+		 */
+		uint8_t getCapabilities() const noexcept;
+
+		/**
+		 * Gets the free subnets of a SubnetMap.
+		 * Must only be called on valid packets.
+		 * \sa fromSubnetMap()
+		 */
+		std::array<uint8_t, 32> getSubnetMap() const noexcept;
+
+		/**
+		 * Gets the MTU of an IpProposal, IpAccept or SubnetMap.
+		 * \return 0 if the sender didn't send any
+		 */
+		uint16_t getMtu() const noexcept;
+
 		/**
 		 * Whether or not the fragment seems to be valid.
 		 * \sa getSplittedDataIndex()
@@ -162,26 +303,75 @@ class Data {
 
 		/**
 		 * Gets the set index from a fragment packet.
-		 * Never throws if isValidFragment returns true.
+		 * Only valid if isValidFragment returns true.
 		 */
-		uint8_t getSplittedDataIndex() const;
+		uint8_t getSplittedDataIndex() const noexcept;
 
 		/**
 		 * Gets the count of fragments in the set from a fragment packet.
-		 * Never throws if isValidFragment returns true.
+		 * Only valid if isValidFragment returns true.
+		 */
+		uint8_t getFragmentsCount() const noexcept;
+
+		/**
+		 * Gets the index of the fragment in its set from a fragment packet.
+		 * Only valid if isValidFragment returns true.
 		 */
-		uint8_t getFragmentsCount() const;
+		uint8_t getFragmentIndex() const noexcept;
 
 		/**
-		 * Gets a list of splitted packegs that fit TOX_MAX_CUSTOM_PACKAGE_SIZE.
+		 * Gets a list of fragments that fit TOX_MAX_CUSTOM_PACKAGE_SIZE.
+		 * The fragments only refer to slices of this packet, use
+		 * sendFragment() to send them.
+		 * The list is empty if the packet needs more than 255 fragments.
 		 */
-		std::forward_list<Data> getSplitted(uint8_t splittedDataIndex) const;
+		std::vector<Fragment> getSplitted(uint8_t splittedDataIndex) const;
+
+		/**
+		 * Sends a fragment returned by getSplitted() without copying it.
+		 * The header is temporarily written in front of the slice,
+		 * so fragment and header can be passed to send as one buffer.
+		 * This is only done if no other packet shares the buffer,
+		 * otherwise the slice is copied.
+		 * \param[in] fragment Fragment of this packet
+		 * \param[in] send Callable taking (const uint8_t*, size_t) and
+		 * returning whether or not sending succeeded
+		 * \return The value returned by send
+		 */
+		template<typename Function>
+		bool sendFragment(const Fragment &fragment, Function send) const;
 
 		/**
 		 * Gets the type of connection the packet must be send over via tox.
+		 * \sa PacketType
 		 */
-		SendTox getSendTox() const;
+		SendTox getSendTox() const noexcept;
 };
 
+template<typename Function>
+bool Data::sendFragment(const Fragment &fragment, Function send) const {
+	constexpr size_t headerLen = sizeof(fragment.header);
+
+	if (buffer.useCount() != 1 || offset + fragment.pos < headerLen) {
+		//Shared or no room in front of the slice, so fall back to copying it
+		uint8_t tmp[headerLen + BufferPool::bufferSize];
+		if (fragment.len > BufferPool::bufferSize) return false;
+
+		memcpy(tmp, fragment.header, headerLen);
+		memcpy(tmp + headerLen, bytes() + fragment.pos, fragment.len);
+		return send(static_cast<const uint8_t*>(tmp), headerLen + fragment.len);
+	}
+
+	uint8_t *start = bytes() + fragment.pos - headerLen;
+	uint8_t saved[headerLen];
+
+	memcpy(saved, start, headerLen);
+	memcpy(start, fragment.header, headerLen);
+	const bool status = send(static_cast<const uint8_t*>(start), headerLen + fragment.len);
+	memcpy(start, saved, headerLen);
+
+	return status;
+}
+
 #endif //DATA_HPP
 
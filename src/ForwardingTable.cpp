@@ -0,0 +1,146 @@
+/* 
+ * Copyright (C) 2015 Johannes Schwab
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ForwardingTable.hpp"
+#include "Data.hpp"
+#include "Logger.hpp"
+
+#include <new>
+
+constexpr size_t ForwardingTable::maxMacsPerFriend;
+
+uint64_t ForwardingTable::macKey(const uint8_t *mac) noexcept {
+	uint64_t key = 0;
+	for (size_t i = 0; i < 6; ++i) key = key << 8 | mac[i];
+
+	return key;
+}
+
+uint32_t ForwardingTable::ip4Key(const uint8_t *ip) noexcept {
+	return
+		static_cast<uint32_t>(ip[0]) << 24 | static_cast<uint32_t>(ip[1]) << 16 |
+		static_cast<uint32_t>(ip[2]) << 8 | static_cast<uint32_t>(ip[3]);
+}
+
+template <typename Key>
+bool ForwardingTable::find(
+		const std::unordered_map<Key, uint32_t> &table,
+		Key key,
+		uint32_t &friendNumber
+) noexcept {
+	const auto entry = table.find(key);
+	if (entry == table.end()) return false;
+
+	friendNumber = entry->second;
+	return true;
+}
+
+void ForwardingTable::addIp4(const uint8_t *ip, uint32_t friendNumber) noexcept {
+	try {
+		ip4s[ip4Key(ip)] = friendNumber;
+	} catch (std::bad_alloc &error) {
+		Logger::error("Can't add IPv4 address of ", friendNumber, " to forwarding table");
+	}
+}
+
+bool ForwardingTable::learn(const Data &frame, uint32_t friendNumber) noexcept {
+	const size_t len = frame.getIpDataLen();
+	const uint8_t *tmp = frame.getIpData();
+	if (len < 14 || (tmp[6] & 0x01)) return false; //Group addresses are no valid source
+
+	//0.0.0.0 is used while probing for an address
+	const uint8_t *source = nullptr;
+	if (tmp[12] == 0x08 && tmp[13] == 0x00) { //IPv4
+		if (len < 14 + 20) return false;
+		source = tmp + 14 + 12;
+	} else if (tmp[12] == 0x08 && tmp[13] == 0x06) { //ARP
+		if (len < 14 + 28) return false;
+		source = tmp + 14 + 14;
+	}
+	uint32_t owner;
+	if (
+			source && ip4Key(source) != 0 &&
+			(!find(ip4s, ip4Key(source), owner) || owner != friendNumber)
+	) {
+		Logger::debug("Dropping frame of ", friendNumber, " with foreign IPv4 address");
+		return false;
+	}
+
+	const uint64_t key = macKey(tmp + 6);
+	if (find(macs, key, owner)) {
+		if (owner == friendNumber) return true;
+
+		Logger::debug("Dropping frame of ", friendNumber, " with ethernet address of ", owner);
+		return false;
+	}
+
+	try {
+		std::deque<uint64_t> &own = friendMacs[friendNumber];
+		if (own.size() >= maxMacsPerFriend) {
+			forget(own.front(), friendNumber);
+			own.pop_front();
+		}
+
+		own.push_back(key);
+		macs.emplace(key, friendNumber);
+	} catch (std::bad_alloc &error) {
+		//The frame is still forwarded, only its address isn't learned
+	}
+
+	return true;
+}
+
+void ForwardingTable::forget(uint64_t key, uint32_t friendNumber) noexcept {
+	const auto entry = macs.find(key);
+	if (entry != macs.end() && entry->second == friendNumber) macs.erase(entry);
+}
+
+void ForwardingTable::remove(uint32_t friendNumber) noexcept {
+	const auto own = friendMacs.find(friendNumber);
+	if (own != friendMacs.end()) {
+		for (uint64_t key : own->second) forget(key, friendNumber);
+		friendMacs.erase(own);
+	}
+
+	for (auto i = ip4s.begin(); i != ip4s.end();) {
+		if (i->second == friendNumber)
+			i = ip4s.erase(i);
+		else
+			++i;
+	}
+}
+
+bool ForwardingTable::lookup(const Data &frame, uint32_t &friendNumber) const noexcept {
+	const size_t len = frame.getIpDataLen();
+	const uint8_t *tmp = frame.getIpData();
+	if (len < 14) return false;
+
+	const bool arp = tmp[12] == 0x08 && tmp[13] == 0x06;
+	const bool ip4 = tmp[12] == 0x08 && tmp[13] == 0x00;
+
+	if ((tmp[0] & 0x01) == 0) {
+		if (find(macs, macKey(tmp), friendNumber)) return true;
+
+		//Friend didn't send anything yet, but its address is known
+		return ip4 && len >= 14 + 20 && find(ip4s, ip4Key(tmp + 14 + 16), friendNumber);
+	}
+
+	//ARP requests have to reach the owner of the target address only
+	return
+		arp && len >= 14 + 28 && tmp[14 + 6] == 0x00 && tmp[14 + 7] == 0x01 &&
+		find(ip4s, ip4Key(tmp + 14 + 24), friendNumber);
+}
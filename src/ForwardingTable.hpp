@@ -0,0 +1,116 @@
+/* 
+ * Copyright (C) 2015 Johannes Schwab
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FORWARDING_TABLE_HPP
+#define FORWARDING_TABLE_HPP
+
+/** \file */
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <unordered_map>
+
+class Data;
+
+/**
+ * Maps the destination of ethernet frames read from the hub tun
+ * interface to the friend they have to be sent to.
+ * IPv4 addresses are added by the handshake, ethernet addresses are
+ * learned from the frames received from friends.
+ * A friend can't take over the addresses of another one.
+ */
+class ForwardingTable {
+	public:
+		/**
+		 * Maximal number of learned ethernet addresses per friend.
+		 * The oldest address of the friend is forgotten for a new one.
+		 */
+		static constexpr size_t maxMacsPerFriend = 64;
+
+	private:
+		std::unordered_map<uint64_t, uint32_t> macs; /**< Ethernet address to friend */
+		std::unordered_map<uint32_t, uint32_t> ip4s; /**< IPv4 address to friend */
+
+		/**
+		 * Ethernet addresses of each friend, oldest first.
+		 */
+		std::unordered_map<uint32_t, std::deque<uint64_t>> friendMacs;
+
+		/**
+		 * Gets the key of an ethernet address.
+		 */
+		static uint64_t macKey(const uint8_t *mac) noexcept;
+
+		/**
+		 * Gets the key of an IPv4 address.
+		 */
+		static uint32_t ip4Key(const uint8_t *ip) noexcept;
+
+		/**
+		 * Looks the key up in the table.
+		 * \return false if it isn't known
+		 */
+		template <typename Key>
+		static bool find(
+				const std::unordered_map<Key, uint32_t> &table,
+				Key key,
+				uint32_t &friendNumber
+		) noexcept;
+
+		/**
+		 * Removes an ethernet address if it belongs to friend.
+		 */
+		void forget(uint64_t key, uint32_t friendNumber) noexcept;
+
+	public:
+		ForwardingTable() = default;
+
+		ForwardingTable(const ForwardingTable&) = delete; /**< Deleted */
+		ForwardingTable& operator=(const ForwardingTable&) = delete; /**< Deleted */
+
+		/**
+		 * Adds the IPv4 address assigned to friend by the handshake.
+		 */
+		void addIp4(const uint8_t *ip, uint32_t friendNumber) noexcept;
+
+		/**
+		 * Learns the source ethernet address of a frame received from
+		 * friend.
+		 * \return false if the frame has to be dropped, because its
+		 * ethernet address belongs to another friend or its IPv4 or
+		 * ARP sender address isn't the one assigned to friend
+		 */
+		bool learn(const Data &frame, uint32_t friendNumber) noexcept;
+
+		/**
+		 * Removes all addresses of friend.
+		 */
+		void remove(uint32_t friendNumber) noexcept;
+
+		/**
+		 * Gets the friend a frame read from the tun interface is
+		 * destined to.
+		 * ARP requests are resolved by their target address.
+		 * \param[out] friendNumber Friend to send the frame to
+		 * \return false if no single friend is known, broadcasts and
+		 * multicasts have to be flooded then, unicasts dropped
+		 */
+		bool lookup(const Data &frame, uint32_t &friendNumber) const noexcept;
+};
+
+#endif //FORWARDING_TABLE_HPP
@@ -0,0 +1,484 @@
+/* 
+ * Copyright (C) 2015 Johannes Schwab
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef __unix
+
+#include "Netlink.hpp"
+#include "Logger.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <vector>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+bool Netlink::opened = false;
+int Netlink::requestFd = -1;
+int Netlink::eventFd = -1;
+uint32_t Netlink::sequence = 0;
+std::mutex Netlink::mutex;
+std::set<std::pair<uint32_t, uint32_t>> Netlink::addresses;
+std::array<uint16_t, 256> Netlink::subnetUsers = {};
+
+/**
+ * Size of the buffers netlink messages are received in.
+ */
+static constexpr size_t receiveBufferLen = 16384;
+
+/**
+ * Netlink messages sent to the kernel with a single send().
+ * The buffer fits the few short messages of Netlink::configure().
+ */
+class Batch {
+	private:
+		alignas(NLMSG_ALIGNTO) uint8_t buffer[512]; /**< The messages */
+		size_t len; /**< Bytes of the finished messages */
+		nlmsghdr *message; /**< Message currently built */
+
+	public:
+		Batch() noexcept : buffer(), len(0), message(nullptr) {}
+
+		/**
+		 * Starts a new message.
+		 * \return The zeroed payload of payloadLen bytes
+		 */
+		void* begin(uint16_t type, uint16_t flags, uint32_t sequence, size_t payloadLen) noexcept {
+			message = reinterpret_cast<nlmsghdr*>(buffer + len);
+			message->nlmsg_len = NLMSG_LENGTH(payloadLen);
+			message->nlmsg_type = type;
+			message->nlmsg_flags = flags;
+			message->nlmsg_seq = sequence;
+
+			return NLMSG_DATA(message);
+		}
+
+		/**
+		 * Appends an attribute to the current message.
+		 */
+		void attribute(uint16_t type, const void *data, size_t dataLen) noexcept {
+			rtattr *attr = reinterpret_cast<rtattr*>(
+					reinterpret_cast<uint8_t*>(message) + NLMSG_ALIGN(message->nlmsg_len)
+			);
+			attr->rta_type = type;
+			attr->rta_len = RTA_LENGTH(dataLen);
+			std::memcpy(RTA_DATA(attr), data, dataLen);
+
+			message->nlmsg_len = NLMSG_ALIGN(message->nlmsg_len) + RTA_ALIGN(attr->rta_len);
+		}
+
+		/**
+		 * Finishes the current message.
+		 */
+		void end() noexcept {
+			len += NLMSG_ALIGN(message->nlmsg_len);
+		}
+
+		/**
+		 * Sends all messages.
+		 */
+		bool send(int fd) const noexcept {
+			struct sockaddr_nl kernel = {};
+			kernel.nl_family = AF_NETLINK;
+
+			return sendto(
+					fd, buffer, len, 0,
+					reinterpret_cast<const sockaddr*>(&kernel), sizeof(kernel)
+			) == static_cast<ssize_t>(len);
+		}
+};
+
+/**
+ * Receives the answer to a dump request.
+ * \param[in] handler Called with every message of the answer
+ * \return false on failure
+ */
+template <typename Handler>
+static bool receiveDump(int fd, uint32_t sequence, Handler handler) noexcept {
+	alignas(NLMSG_ALIGNTO) uint8_t buffer[receiveBufferLen];
+	while (true) {
+		const ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+		if (n < 0) return false;
+
+		int len = n;
+		for (
+				nlmsghdr *message = reinterpret_cast<nlmsghdr*>(buffer);
+				NLMSG_OK(message, len);
+				message = NLMSG_NEXT(message, len)
+		) {
+			if (message->nlmsg_seq != sequence) continue;
+			if (message->nlmsg_type == NLMSG_DONE) return true;
+			if (message->nlmsg_type == NLMSG_ERROR) return false;
+
+			handler(message);
+		}
+	}
+}
+
+/**
+ * Receives the acknowledgements of count requests sent with consecutive
+ * sequence numbers.
+ * \param[out] errors errno of each request, ETIMEDOUT if it wasn't
+ * answered
+ */
+static void receiveAcks(int fd, uint32_t first, int *errors, size_t count) noexcept {
+	for (size_t i = 0; i < count; ++i) errors[i] = ETIMEDOUT;
+
+	size_t answered = 0;
+	alignas(NLMSG_ALIGNTO) uint8_t buffer[receiveBufferLen];
+	while (answered < count) {
+		const ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+		if (n < 0) {
+			const char *errStr = std::strerror(errno);
+			Logger::error("No answer to netlink request: ", errStr);
+			break;
+		}
+
+		int len = n;
+		for (
+				nlmsghdr *message = reinterpret_cast<nlmsghdr*>(buffer);
+				NLMSG_OK(message, len);
+				message = NLMSG_NEXT(message, len)
+		) {
+			if (message->nlmsg_type != NLMSG_ERROR) continue;
+			if (message->nlmsg_seq < first || message->nlmsg_seq >= first + count) continue;
+
+			const nlmsgerr *error = static_cast<const nlmsgerr*>(NLMSG_DATA(message));
+			errors[message->nlmsg_seq - first] = -error->error;
+			++answered;
+		}
+	}
+}
+
+bool Netlink::open() noexcept {
+	if (opened) return requestFd >= 0;
+	opened = true;
+
+	requestFd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	eventFd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+
+	//Requests are answered right away, don't hang if they aren't
+	struct timeval timeout = {1, 0};
+	struct sockaddr_nl local = {};
+	local.nl_family = AF_NETLINK;
+	local.nl_groups = RTMGRP_IPV4_IFADDR;
+
+	//Subscribe before reading the addresses, so no change gets lost
+	if (
+			requestFd < 0 || eventFd < 0 ||
+			setsockopt(requestFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ||
+			bind(eventFd, reinterpret_cast<sockaddr*>(&local), sizeof(local)) < 0 ||
+			!dump()
+	) {
+		const char *errStr = std::strerror(errno);
+		Logger::error("Can't use rtnetlink, falling back to ioctl: ", errStr);
+
+		if (requestFd >= 0) close(requestFd);
+		if (eventFd >= 0) close(eventFd);
+		requestFd = eventFd = -1;
+		return false;
+	}
+
+	Logger::debug("Using rtnetlink to configure tun interfaces");
+	return true;
+}
+
+bool Netlink::dump() noexcept {
+	addresses.clear();
+	subnetUsers.fill(0);
+
+	Batch batch;
+	ifaddrmsg *request = static_cast<ifaddrmsg*>(
+			batch.begin(RTM_GETADDR, NLM_F_REQUEST | NLM_F_DUMP, ++sequence, sizeof(ifaddrmsg))
+	);
+	request->ifa_family = AF_INET;
+	batch.end();
+
+	if (!batch.send(requestFd)) return false;
+
+	return receiveDump(requestFd, sequence, handleAddress);
+}
+
+void Netlink::readEvents() noexcept {
+	alignas(NLMSG_ALIGNTO) uint8_t buffer[receiveBufferLen];
+	while (true) {
+		const ssize_t n = recv(eventFd, buffer, sizeof(buffer), 0);
+		if (n < 0) {
+			if (errno != ENOBUFS) return;
+
+			//The kernel dropped events, the addresses have to be read again
+			Logger::debug("Netlink events lost, reading addresses again");
+			if (!dump()) Logger::error("Can't read used IP addresses");
+			continue;
+		}
+
+		int len = n;
+		for (
+				nlmsghdr *message = reinterpret_cast<nlmsghdr*>(buffer);
+				NLMSG_OK(message, len);
+				message = NLMSG_NEXT(message, len)
+		) {
+			handleAddress(message);
+		}
+	}
+}
+
+void Netlink::handleAddress(const nlmsghdr *message) noexcept {
+	const bool added = message->nlmsg_type == RTM_NEWADDR;
+	if (!added && message->nlmsg_type != RTM_DELADDR) return;
+
+	ifaddrmsg *info = static_cast<ifaddrmsg*>(NLMSG_DATA(message));
+	if (info->ifa_family != AF_INET) return;
+
+	const uint8_t *address = nullptr;
+	int len = IFA_PAYLOAD(message);
+	for (rtattr *attr = IFA_RTA(info); RTA_OK(attr, len); attr = RTA_NEXT(attr, len)) {
+		if (RTA_PAYLOAD(attr) != 4) continue;
+
+		//IFA_ADDRESS is the peer of point to point interfaces
+		if (attr->rta_type == IFA_LOCAL || (attr->rta_type == IFA_ADDRESS && !address))
+			address = static_cast<const uint8_t*>(RTA_DATA(attr));
+	}
+	if (!address || address[0] != 192 || address[1] != 168) return;
+
+	uint32_t key;
+	std::memcpy(&key, address, sizeof(key));
+	const std::pair<uint32_t, uint32_t> entry(info->ifa_index, key);
+
+	//Dumps and events may report the same address twice
+	if (added) {
+		try {
+			if (addresses.insert(entry).second) ++subnetUsers[address[2]];
+		} catch (std::bad_alloc &error) {
+			Logger::error("Can't remember used IP address");
+		}
+	} else if (addresses.erase(entry)) {
+		--subnetUsers[address[2]];
+	}
+}
+
+bool Netlink::configure(
+		const std::string &name,
+		uint8_t subnet,
+		uint8_t postfix,
+		uint16_t mtu,
+		bool &mtuApplied
+) noexcept {
+	mtuApplied = false;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!open()) return false;
+
+	const unsigned int index = if_nametoindex(name.c_str());
+	if (!index) {
+		const char *errStr = std::strerror(errno);
+		Logger::error("Can't get index of ", name, ": ", errStr);
+		return false;
+	}
+
+	Batch batch;
+	const uint32_t first = sequence + 1;
+	constexpr uint16_t flags = NLM_F_REQUEST | NLM_F_ACK;
+	constexpr uint16_t createFlags = flags | NLM_F_CREATE | NLM_F_REPLACE;
+
+	//The MTU has its own request, so the interface comes up even if it is refused
+	ifinfomsg *link = static_cast<ifinfomsg*>(
+			batch.begin(RTM_NEWLINK, flags, ++sequence, sizeof(ifinfomsg))
+	);
+	link->ifi_family = AF_UNSPEC;
+	link->ifi_index = index;
+	const uint32_t mtu32 = mtu;
+	batch.attribute(IFLA_MTU, &mtu32, sizeof(mtu32));
+	batch.end();
+
+	link = static_cast<ifinfomsg*>(
+			batch.begin(RTM_NEWLINK, flags, ++sequence, sizeof(ifinfomsg))
+	);
+	link->ifi_family = AF_UNSPEC;
+	link->ifi_index = index;
+	link->ifi_flags = IFF_UP;
+	link->ifi_change = IFF_UP;
+	batch.end();
+
+	const uint8_t ip4[4] = {192, 168, subnet, postfix};
+	const uint8_t broadcast[4] = {192, 168, subnet, 255};
+	ifaddrmsg *address = static_cast<ifaddrmsg*>(
+			batch.begin(RTM_NEWADDR, createFlags, ++sequence, sizeof(ifaddrmsg))
+	);
+	address->ifa_family = AF_INET;
+	address->ifa_prefixlen = 24;
+	address->ifa_scope = RT_SCOPE_UNIVERSE;
+	address->ifa_index = index;
+	batch.attribute(IFA_LOCAL, ip4, sizeof(ip4));
+	batch.attribute(IFA_ADDRESS, ip4, sizeof(ip4));
+	batch.attribute(IFA_BROADCAST, broadcast, sizeof(broadcast));
+	batch.end();
+
+	//Unique local address, the global ID spells "toxtun"
+	const uint8_t ip6[16] = {0xFD, 0x74, 0x6F, 0x78, 0x74, 0x75, 0x00, subnet, 0, 0, 0, 0, 0, 0, 0, postfix};
+	address = static_cast<ifaddrmsg*>(
+			batch.begin(RTM_NEWADDR, createFlags, ++sequence, sizeof(ifaddrmsg))
+	);
+	address->ifa_family = AF_INET6;
+	address->ifa_prefixlen = 64;
+	address->ifa_flags = IFA_F_NODAD;
+	address->ifa_scope = RT_SCOPE_UNIVERSE;
+	address->ifa_index = index;
+	batch.attribute(IFA_ADDRESS, ip6, sizeof(ip6));
+	batch.end();
+
+	if (!batch.send(requestFd)) {
+		const char *errStr = std::strerror(errno);
+		Logger::error("Can't send netlink request: ", errStr);
+		return false;
+	}
+
+	int errors[4];
+	receiveAcks(requestFd, first, errors, 4);
+
+	mtuApplied = errors[0] == 0;
+	if (mtuApplied) {
+		Logger::debug("MTU set to ", mtu);
+	} else {
+		Logger::error("Setting MTU to ", mtu, " with netlink failed: ", std::strerror(errors[0]));
+	}
+
+	if (errors[1] == 0) {
+		Logger::debug("Tun interface successfully set up");
+	} else {
+		Logger::error("Bringing up interface with netlink failed: ", std::strerror(errors[1]));
+		Logger::error("Please set ", name, " up manually");
+	}
+
+	if (errors[2] != 0) {
+		Logger::error("Setting ip with netlink failed: ", std::strerror(errors[2]));
+		Logger::error(
+				"Please set IPv4 to 192.168.", static_cast<int>(subnet), ".",
+				static_cast<int>(postfix), "/24 manually"
+		);
+	}
+
+	//IPv6 may be disabled on purpose
+	if (errors[3] != 0) {
+		Logger::debug("Setting IPv6 with netlink failed: ", std::strerror(errors[3]));
+	}
+
+	return true;
+}
+
+bool Netlink::isSubnetUsed(uint8_t subnet, bool &used) noexcept {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!open()) return false;
+
+	readEvents();
+	used = subnetUsers[subnet] != 0;
+
+	return true;
+}
+
+bool Netlink::removeAddresses(const std::string &name) noexcept {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!open()) return false;
+
+	const unsigned int index = if_nametoindex(name.c_str());
+	if (!index) {
+		const char *errStr = std::strerror(errno);
+		Logger::error("Can't get index of ", name, ": ", errStr);
+		return false;
+	}
+
+	//The request of every address to delete, built while reading them
+	std::vector<uint8_t> requests;
+	const uint32_t dumpSequence = ++sequence;
+	const uint32_t first = sequence + 1;
+
+	Batch batch;
+	ifaddrmsg *dumpRequest = static_cast<ifaddrmsg*>(
+			batch.begin(RTM_GETADDR, NLM_F_REQUEST | NLM_F_DUMP, dumpSequence, sizeof(ifaddrmsg))
+	);
+	dumpRequest->ifa_family = AF_UNSPEC;
+	batch.end();
+
+	bool allocated = true;
+	const bool dumped = batch.send(requestFd) && receiveDump(
+			requestFd, dumpSequence,
+			[&](const nlmsghdr *message) noexcept {
+				if (message->nlmsg_type != RTM_NEWADDR) return;
+
+				const ifaddrmsg *info = static_cast<const ifaddrmsg*>(NLMSG_DATA(message));
+				if (info->ifa_index != index || info->ifa_scope == RT_SCOPE_LINK) return;
+
+				//Like "ip address flush", the dumped address is turned into the request deleting it
+				try {
+					const uint8_t *begin = reinterpret_cast<const uint8_t*>(message);
+					const size_t offset = requests.size();
+					requests.insert(requests.end(), begin, begin + NLMSG_ALIGN(message->nlmsg_len));
+
+					nlmsghdr *request = reinterpret_cast<nlmsghdr*>(requests.data() + offset);
+					request->nlmsg_type = RTM_DELADDR;
+					request->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+					request->nlmsg_seq = ++sequence;
+					request->nlmsg_pid = 0;
+				} catch (std::bad_alloc &error) {
+					allocated = false;
+				}
+			}
+	);
+	if (!dumped || !allocated) {
+		const char *errStr = dumped ? "Out of memory" : std::strerror(errno);
+		Logger::error("Can't read addresses of ", name, ": ", errStr);
+		return false;
+	}
+
+	const size_t count = sequence + 1 - first;
+	if (!count) return true;
+
+	struct sockaddr_nl kernel = {};
+	kernel.nl_family = AF_NETLINK;
+	if (
+			sendto(
+					requestFd, requests.data(), requests.size(), 0,
+					reinterpret_cast<const sockaddr*>(&kernel), sizeof(kernel)
+			) != static_cast<ssize_t>(requests.size())
+	) {
+		const char *errStr = std::strerror(errno);
+		Logger::error("Can't send netlink request: ", errStr);
+		return false;
+	}
+
+	std::vector<int> errors;
+	try {
+		errors.resize(count);
+	} catch (std::bad_alloc &error) {
+		//The kernel still deletes the addresses
+		return true;
+	}
+	receiveAcks(requestFd, first, errors.data(), count);
+
+	for (int error : errors) {
+		if (error != 0 && error != EADDRNOTAVAIL)
+			Logger::error("Removing ip with netlink failed: ", std::strerror(error));
+	}
+
+	return true;
+}
+
+#endif //__unix
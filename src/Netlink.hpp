@@ -0,0 +1,122 @@
+/* 
+ * Copyright (C) 2015 Johannes Schwab
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NETLINK_HPP
+#define NETLINK_HPP
+
+/** \file */
+
+#ifdef __unix
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+
+struct nlmsghdr;
+
+/**
+ * Configures network interfaces with rtnetlink and keeps track of the
+ * 192.168.<subnet>.0 subnets in use.
+ * The used subnets are read once and updated from the address events
+ * of the kernel afterwards, so checking a subnet doesn't scan all
+ * interfaces. The sockets are opened on first use and shared by all tun
+ * interfaces, all functions are thread safe.
+ */
+class Netlink {
+	private:
+		static bool opened; /**< Whether or not open() was called */
+		static int requestFd; /**< Socket for requests, -1 if not avaible */
+		static int eventFd; /**< Socket subscribed to IPv4 address events */
+		static uint32_t sequence; /**< Sequence number of the last request */
+		static std::mutex mutex; /**< Protects all of the above */
+
+		/**
+		 * Interface index and address of every 192.168.x.y address.
+		 */
+		static std::set<std::pair<uint32_t, uint32_t>> addresses;
+
+		/**
+		 * Number of addresses in each 192.168.<subnet>.0 subnet.
+		 */
+		static std::array<uint16_t, 256> subnetUsers;
+
+		/**
+		 * Opens the sockets and reads the addresses in use.
+		 * \return false if netlink isn't avaible
+		 */
+		static bool open() noexcept;
+
+		/**
+		 * Forgets all addresses and reads them again.
+		 * \return false on failure
+		 */
+		static bool dump() noexcept;
+
+		/**
+		 * Applies the address events received since the last call.
+		 */
+		static void readEvents() noexcept;
+
+		/**
+		 * Adds or removes the address of a RTM_NEWADDR or RTM_DELADDR
+		 * message.
+		 */
+		static void handleAddress(const nlmsghdr *message) noexcept;
+
+	public:
+		Netlink() = delete; /**< Deleted */
+
+		/**
+		 * Brings the interface up, sets its MTU, IPv4 address
+		 * 192.168.<subnet>.<postfix>/24 and IPv6 address
+		 * fd74:6f78:7475:<subnet>::<postfix>/64 with a single batch of
+		 * requests. Failures are logged.
+		 * \param[out] mtuApplied Whether or not the MTU was set
+		 * \return false if netlink isn't avaible and nothing was done
+		 */
+		static bool configure(
+				const std::string &name,
+				uint8_t subnet,
+				uint8_t postfix,
+				uint16_t mtu,
+				bool &mtuApplied
+		) noexcept;
+
+		/**
+		 * Whether or not any interface has an address in
+		 * 192.168.<subnet>.0/24.
+		 * \param[out] used Whether or not the subnet is in use
+		 * \return false if netlink isn't avaible
+		 */
+		static bool isSubnetUsed(uint8_t subnet, bool &used) noexcept;
+
+		/**
+		 * Removes the IPv4 and IPv6 addresses of the interface and with
+		 * them their routes. Link local addresses are kept.
+		 * \return false if netlink isn't avaible or the addresses can't
+		 * be read
+		 */
+		static bool removeAddresses(const std::string &name) noexcept;
+};
+
+#endif //__unix
+
+#endif //NETLINK_HPP
@@ -0,0 +1,110 @@
+/* 
+ * Copyright (C) 2015 Johannes Schwab
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PacketType.hpp"
+#include "Connection.hpp"
+
+namespace {
+	/**
+	 * List of indices, replacement for C++14 std::index_sequence
+	 */
+	template<size_t ... I>
+	struct Indices {};
+
+	/**
+	 * Creates Indices<0, ..., N-1>
+	 */
+	template<size_t N, size_t ... I>
+	struct MakeIndices : MakeIndices<N - 1, N - 1, I ...> {};
+
+	/**
+	 * End of recursion
+	 */
+	template<size_t ... I>
+	struct MakeIndices<0, I ...> {
+		using Type = Indices<I ...>;
+	};
+} //namespace
+
+/**
+ * Table with the properties of all packet ids.
+ * Friend of Connection to reach the handlers.
+ */
+struct PacketTypeTable {
+	PacketType types[256]; /**< Indexed by the packet id */
+
+	/**
+	 * Properties of a single id
+	 */
+	static constexpr PacketType describe(size_t id) {
+		using Id = Data::PacketId;
+		using Send = Data::SendTox;
+
+		return
+			id == static_cast<size_t>(Id::ConnectionRequest) ?
+				PacketType{&Connection::handleConnectionRequest, Send::Lossless, 1} :
+			id == static_cast<size_t>(Id::ConnectionAccept) ?
+				PacketType{&Connection::handleConnectionAccepted, Send::Lossless, 1} :
+			id == static_cast<size_t>(Id::ConnectionReject) ?
+				PacketType{&Connection::handleConnectionRejected, Send::Lossless, 1} :
+			id == static_cast<size_t>(Id::ConnectionClose) ?
+				PacketType{&Connection::handleConnectionClosed, Send::Lossless, 1} :
+			id == static_cast<size_t>(Id::ConnectionReset) ?
+				PacketType{&Connection::handleConnectionReset, Send::Lossless, 1} :
+			id == static_cast<size_t>(Id::IpProposal) ?
+				PacketType{&Connection::handleIpProposal, Send::Lossless, 3} :
+			id == static_cast<size_t>(Id::IpAccept) ?
+				PacketType{&Connection::handleIpAccepted, Send::Lossless, 1} :
+			id == static_cast<size_t>(Id::IpReject) ?
+				PacketType{&Connection::handleIpRejected, Send::Lossless, 1} :
+			id == static_cast<size_t>(Id::SubnetMap) ?
+				PacketType{&Connection::handleSubnetMap, Send::Lossless, 1 + 32 + 2} :
+			id == static_cast<size_t>(Id::Data) ?
+				PacketType{&Connection::sendToTun, Send::Lossy, 1 + 14} :
+			id == static_cast<size_t>(Id::Fragment) ?
+				PacketType{&Connection::handleFragment, Send::Lossy, 4} :
+			PacketType{nullptr, Send::Lossless, 0};
+	}
+
+	/**
+	 * Creates the table
+	 */
+	template<size_t ... I>
+	static constexpr PacketTypeTable make(Indices<I ...>) {
+		return PacketTypeTable{{describe(I) ...}};
+	}
+};
+
+/**
+ * The table, created at compile time
+ */
+static constexpr PacketTypeTable packetTypeTable =
+	PacketTypeTable::make(MakeIndices<256>::Type());
+
+const PacketType& PacketType::get(Data::PacketId id) noexcept {
+	return packetTypeTable.types[static_cast<uint8_t>(id)];
+}
+
+ToxTun::DropReason PacketType::validate(const Data &data) noexcept {
+	const PacketType &type = get(data.getToxHeader());
+
+	if (!type.handler || data.getToxDataLen() < type.minLen) {
+		return ToxTun::DropReason::InvalidPacket;
+	}
+
+	return ToxTun::DropReason::None;
+}
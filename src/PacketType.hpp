@@ -0,0 +1,56 @@
+/* 
+ * Copyright (C) 2015 Johannes Schwab
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PACKET_TYPE_HPP
+#define PACKET_TYPE_HPP
+
+/** \file */
+
+#include "Data.hpp"
+#include "ToxTun.hpp"
+
+class Connection;
+
+/**
+ * Properties of a packet id.
+ * There is one compile time entry for every possible id, so packets
+ * received via tox are validated and dispatched with one lookup.
+ */
+struct PacketType {
+	/**
+	 * Handler for a packet received via tox
+	 */
+	using Handler = void (Connection::*)(const Data &data);
+
+	Handler handler; /**< Handler in Connection, nullptr for unknown ids */
+	Data::SendTox sendTox; /**< How to send the packet via tox */
+	size_t minLen; /**< Minimal length including the tox header */
+
+	/**
+	 * Gets the properties of the packet id.
+	 */
+	static const PacketType& get(Data::PacketId id) noexcept;
+
+	/**
+	 * Checks id and length of a packet received via tox.
+	 * \return ToxTun::DropReason::None if the packet may be passed
+	 * to its handler
+	 */
+	static ToxTun::DropReason validate(const Data &data) noexcept;
+};
+
+#endif //PACKET_TYPE_HPP
@@ -0,0 +1,124 @@
+/* 
+ * Copyright (C) 2015 Johannes Schwab
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Poller.hpp"
+#include "Logger.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#ifdef __unix
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
+constexpr size_t Poller::maxEvents;
+
+int Poller::getFd() const noexcept {
+	return fd;
+}
+
+#ifdef __unix
+
+Poller::Poller() noexcept
+:
+	fd(epoll_create1(EPOLL_CLOEXEC))
+{
+	if (fd < 0) {
+		const char *errStr = std::strerror(errno);
+		Logger::error("Can't create epoll instance, polling every connection: ", errStr);
+	}
+}
+
+Poller::~Poller() {
+	if (fd >= 0) close(fd);
+}
+
+void Poller::add(Tun &tun, uint32_t friendNumber) noexcept {
+	if (std::find(registered.begin(), registered.end(), friendNumber) != registered.end())
+		return;
+
+	registered.push_back(friendNumber);
+	if (fd < 0) return;
+
+	struct epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.u32 = friendNumber;
+
+	if (epoll_ctl(fd, EPOLL_CTL_ADD, tun.getFd(), &event) < 0) {
+		const char *errStr = std::strerror(errno);
+		Logger::error("Can't add tun interface to epoll: ", errStr);
+	}
+}
+
+void Poller::remove(Tun &tun, uint32_t friendNumber) noexcept {
+	auto it = std::find(registered.begin(), registered.end(), friendNumber);
+	if (it == registered.end()) return;
+
+	registered.erase(it);
+	if (fd < 0) return;
+
+	if (epoll_ctl(fd, EPOLL_CTL_DEL, tun.getFd(), nullptr) < 0) {
+		const char *errStr = std::strerror(errno);
+		Logger::debug("Can't remove tun interface from epoll: ", errStr);
+	}
+}
+
+void Poller::wait(std::vector<uint32_t> &ready) noexcept {
+	ready.clear();
+	if (registered.empty()) return;
+
+	if (fd < 0) {
+		ready = registered;
+		return;
+	}
+
+	struct epoll_event events[maxEvents];
+	const int n = epoll_wait(fd, events, maxEvents, 0);
+	if (n < 0) {
+		const char *errStr = std::strerror(errno);
+		Logger::error("epoll_wait failed: ", errStr);
+		return;
+	}
+
+	for (int i = 0; i < n; ++i) ready.push_back(events[i].data.u32);
+}
+
+#else //__unix
+
+Poller::Poller() noexcept
+:
+	fd(-1)
+{}
+
+Poller::~Poller() {}
+
+void Poller::add(Tun &tun, uint32_t friendNumber) noexcept {
+	if (std::find(registered.begin(), registered.end(), friendNumber) == registered.end())
+		registered.push_back(friendNumber);
+}
+
+void Poller::remove(Tun &tun, uint32_t friendNumber) noexcept {
+	auto it = std::find(registered.begin(), registered.end(), friendNumber);
+	if (it != registered.end()) registered.erase(it);
+}
+
+void Poller::wait(std::vector<uint32_t> &ready) noexcept {
+	ready = registered;
+}
+
+#endif //__unix
@@ -0,0 +1,86 @@
+/* 
+ * Copyright (C) 2015 Johannes Schwab
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef POLLER_HPP
+#define POLLER_HPP
+
+/** \file */
+
+#include "Tun.hpp"
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * Readiness set of the tun interfaces of all connections of a ToxTunCore.
+ * Uses a single epoll instance on linux, so iterating only costs
+ * something for connections with pending frames. On other platforms, or
+ * if epoll isn't avaible, every registered connection is reported as
+ * ready.
+ */
+class Poller {
+	private:
+		/**
+		 * Maximal number of connections reported by one call to wait().
+		 */
+		static constexpr size_t maxEvents = 64;
+
+		int fd; /**< epoll instance, -1 if not avaible */
+		std::vector<uint32_t> registered; /**< Friends of registered tun interfaces */
+
+	public:
+		/**
+		 * Creates the epoll instance.
+		 * Doesn't throw, falls back to reporting every connection as
+		 * ready instead.
+		 */
+		Poller() noexcept;
+
+		Poller(const Poller&) = delete; /**< Deleted */
+		Poller& operator=(const Poller&) = delete; /**< Deleted */
+
+		/**
+		 * Closes the epoll instance.
+		 */
+		~Poller();
+
+		/**
+		 * Watch the tun interface of the connection to friendNumber.
+		 */
+		void add(Tun &tun, uint32_t friendNumber) noexcept;
+
+		/**
+		 * Stop watching the tun interface of the connection to
+		 * friendNumber. Does nothing if it isn't watched.
+		 */
+		void remove(Tun &tun, uint32_t friendNumber) noexcept;
+
+		/**
+		 * Gets a file descriptor that becomes readable once any
+		 * registered tun interface has pending frames.
+		 * \return -1 if not avaible
+		 */
+		int getFd() const noexcept;
+
+		/**
+		 * Gets the friends whose tun interface has pending frames.
+		 * Doesn't block.
+		 * \param[out] ready Friends with pending frames, cleared first
+		 */
+		void wait(std::vector<uint32_t> &ready) noexcept;
+};
+
+#endif //POLLER_HPP
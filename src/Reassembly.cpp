@@ -0,0 +1,320 @@
+/* 
+ * Copyright (C) 2015 Johannes Schwab
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Reassembly.hpp"
+#include "Data.hpp"
+#include "Logger.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <tox/tox.h>
+
+/**
+ * Payload of every fragment except the last one of a set.
+ */
+static constexpr size_t fragmentLen = TOX_MAX_CUSTOM_PACKET_SIZE - 4;
+
+constexpr uint32_t ReassemblyBudget::defaultTimeout;
+constexpr size_t ReassemblyBudget::defaultConnectionLimit;
+constexpr size_t ReassemblyBudget::defaultTotalLimit;
+
+ReassemblyBudget::ReassemblyBudget() noexcept
+:
+	timeout(defaultTimeout),
+	connectionLimit(defaultConnectionLimit),
+	totalLimit(defaultTotalLimit),
+	totalBytes(0),
+	evictions(0)
+{}
+
+void ReassemblyBudget::setLimits(
+		uint32_t timeout,
+		size_t connectionLimit,
+		size_t totalLimit
+) noexcept {
+	this->timeout = std::chrono::milliseconds(timeout);
+	this->connectionLimit = connectionLimit;
+	this->totalLimit = totalLimit;
+}
+
+void ReassemblyBudget::dropStale() noexcept {
+	while (!sets.empty()) {
+		const Entry &e = sets.front();
+		const Reassembly::Slot &slot = e.reassembly->slots[e.splittedDataIndex];
+		if (slot.fragmentsCount != 0 && slot.generation == e.generation) break;
+
+		sets.pop_front();
+	}
+}
+
+bool ReassemblyBudget::evictOldest() noexcept {
+	dropStale();
+	if (sets.empty()) return false;
+
+	const Entry e = sets.front();
+	sets.pop_front();
+	e.reassembly->evict(e.reassembly->slots[e.splittedDataIndex]);
+
+	return true;
+}
+
+void ReassemblyBudget::expire() noexcept {
+	if (sets.empty()) return;
+
+	const auto now = std::chrono::steady_clock::now();
+
+	while (true) {
+		dropStale();
+		if (sets.empty()) break;
+
+		const Entry &e = sets.front();
+		if (now - e.reassembly->slots[e.splittedDataIndex].started < timeout) break;
+
+		Logger::debug("Fragmented packet timed out");
+		evictOldest();
+	}
+}
+
+uint32_t ReassemblyBudget::getNextTimeout() noexcept {
+	dropStale();
+	if (sets.empty()) return std::numeric_limits<uint32_t>::max();
+
+	const Entry &e = sets.front();
+	const auto age = std::chrono::steady_clock::now() -
+		e.reassembly->slots[e.splittedDataIndex].started;
+	if (age >= timeout) return 0;
+
+	//Round up, so the set has timed out once the time passed
+	const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+			timeout - age + std::chrono::milliseconds(1) - std::chrono::nanoseconds(1)
+	);
+
+	return left.count();
+}
+
+size_t ReassemblyBudget::getBytes() const noexcept {
+	return totalBytes;
+}
+
+uint64_t ReassemblyBudget::getEvictions() const noexcept {
+	return evictions;
+}
+
+Reassembly::Reassembly(ReassemblyBudget &budget) noexcept
+:
+	budget(budget),
+	slots(),
+	bytes(0)
+{}
+
+Reassembly::~Reassembly() {
+	for (auto &slot : slots) reset(slot);
+
+	budget.sets.erase(
+			std::remove_if(
+				budget.sets.begin(),
+				budget.sets.end(),
+				[this](const ReassemblyBudget::Entry &e) {
+					return e.reassembly == this;
+				}
+			),
+			budget.sets.end()
+	);
+}
+
+bool Reassembly::makeRoom(size_t len, const Slot &keep) noexcept {
+	while (bytes + len > budget.connectionLimit) {
+		Slot *oldest = nullptr;
+		for (auto &slot : slots) {
+			if (slot.fragmentsCount == 0 || &slot == &keep) continue;
+			if (!oldest || slot.started < oldest->started) oldest = &slot;
+		}
+
+		if (!oldest) return false;
+
+		Logger::debug("Connection reassembly limit reached");
+		evict(*oldest);
+	}
+
+	while (budget.totalBytes + len > budget.totalLimit) {
+		budget.dropStale();
+		if (budget.sets.empty()) return false;
+
+		const ReassemblyBudget::Entry &e = budget.sets.front();
+		if (e.reassembly == this && &slots[e.splittedDataIndex] == &keep) {
+			//Only the set we are working on is left
+			if (budget.sets.size() == 1) return false;
+			std::swap(budget.sets[0], budget.sets[1]);
+			continue;
+		}
+
+		Logger::debug("Total reassembly limit reached");
+		budget.evictOldest();
+	}
+
+	return true;
+}
+
+bool Reassembly::open(Slot &slot, uint8_t fragmentsCount) noexcept {
+	//Only the last fragment may be shorter than fragmentLen, so
+	//try a pooled buffer first if the packet may fit into it.
+	const size_t minLen = (fragmentsCount - 1u) * fragmentLen + 1u;
+	const size_t maxLen = fragmentsCount * fragmentLen;
+	const size_t len = (minLen <= BufferPool::bufferSize) ?
+		BufferPool::bufferSize : maxLen;
+
+	//The sender counts the index up for every packet, so sets in the
+	//half of the slots ahead of this one are 128 packets old. They
+	//can't be completed anymore and must not be mixed with the next
+	//packet using their index.
+	const uint8_t sdi = &slot - &slots[0];
+	for (unsigned int i = 1; i <= slots.size() / 2; ++i)
+		evict(slots[static_cast<uint8_t>(sdi + i)]);
+
+	evict(slot);
+	if (!makeRoom(len, slot)) {
+		Logger::debug("No room to reassemble fragmented packet");
+		return false;
+	}
+
+	try {
+		slot.buffer = BufferRef(len);
+	} catch (std::bad_alloc &e) {
+		Logger::error("Can't allocate memory for fragmented packet");
+		return false;
+	}
+
+	bytes += len;
+	budget.totalBytes += len;
+
+	slot.len = 0;
+	slot.received.reset();
+	slot.started = std::chrono::steady_clock::now();
+	++slot.generation;
+	slot.receivedCount = 0;
+	slot.fragmentsCount = fragmentsCount;
+
+	budget.sets.push_back({this, sdi, slot.generation});
+
+	return true;
+}
+
+bool Reassembly::grow(Slot &slot, size_t len) noexcept {
+	const size_t oldLen = slot.buffer.getCapacity();
+
+	if (!makeRoom(len - oldLen, slot)) {
+		Logger::debug("No room to reassemble fragmented packet");
+		evict(slot);
+		return false;
+	}
+
+	try {
+		BufferRef tmp(len);
+		memcpy(tmp.get(), slot.buffer.get(), oldLen);
+		slot.buffer = std::move(tmp);
+	} catch (std::bad_alloc &e) {
+		Logger::error("Can't allocate memory for fragmented packet");
+		evict(slot);
+		return false;
+	}
+
+	bytes += len - oldLen;
+	budget.totalBytes += len - oldLen;
+
+	return true;
+}
+
+void Reassembly::reset(Slot &slot) noexcept {
+	const size_t len = slot.buffer.getCapacity();
+	bytes -= len;
+	budget.totalBytes -= len;
+
+	slot.buffer = BufferRef();
+	slot.fragmentsCount = 0;
+}
+
+void Reassembly::evict(Slot &slot) noexcept {
+	if (slot.fragmentsCount == 0) return;
+
+	reset(slot);
+	++budget.evictions;
+}
+
+ToxTun::DropReason Reassembly::insert(const Data &fragment, bool &complete) noexcept {
+	const uint8_t sdi = fragment.getSplittedDataIndex();
+	const uint8_t count = fragment.getFragmentsCount();
+	const uint8_t index = fragment.getFragmentIndex();
+	const uint8_t *payload = fragment.getToxData() + 4;
+	const size_t payloadLen = fragment.getToxDataLen() - 4;
+	Slot &slot = slots[sdi];
+
+	complete = false;
+
+	if (count == 0 || index >= count) {
+		Logger::debug("Dropping fragment with invalid index");
+		return ToxTun::DropReason::InvalidFragment;
+	}
+
+	if (index + 1u < count && payloadLen != fragmentLen) {
+		Logger::debug("Dropping fragment with invalid length");
+		evict(slot);
+		return ToxTun::DropReason::InvalidFragment;
+	}
+
+	if (slot.fragmentsCount != count) {
+		//Either unused or a stale set with the same index
+		if (!open(slot, count)) return ToxTun::DropReason::ReassemblyLimit;
+	} else if (slot.received[index]) {
+		Logger::debug("Dropping duplicated fragment");
+		return ToxTun::DropReason::DuplicateFragment;
+	}
+
+	const size_t pos = index * fragmentLen;
+
+	if (pos + payloadLen > slot.buffer.getCapacity()) {
+		//Pooled buffer to small, move to a big one
+		if (!grow(slot, count * fragmentLen)) return ToxTun::DropReason::ReassemblyLimit;
+	}
+
+	memcpy(slot.buffer.get() + pos, payload, payloadLen);
+	if (index + 1u == count) slot.len = pos + payloadLen;
+
+	slot.received[index] = true;
+	++slot.receivedCount;
+
+	complete = (slot.receivedCount == count);
+	return ToxTun::DropReason::None;
+}
+
+Data Reassembly::take(uint8_t splittedDataIndex) noexcept {
+	Slot &slot = slots[splittedDataIndex];
+	const size_t len = slot.buffer.getCapacity();
+	Data data(Data::fromReassembled(std::move(slot.buffer), slot.len));
+
+	bytes -= len;
+	budget.totalBytes -= len;
+	slot.buffer = BufferRef();
+	slot.fragmentsCount = 0;
+
+	return data;
+}
+
+void Reassembly::clear(uint8_t splittedDataIndex) noexcept {
+	evict(slots[splittedDataIndex]);
+}
@@ -0,0 +1,225 @@
+/* 
+ * Copyright (C) 2015 Johannes Schwab
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REASSEMBLY_HPP
+#define REASSEMBLY_HPP
+
+/** \file */
+
+#include "BufferPool.hpp"
+#include "ToxTun.hpp"
+
+#include <array>
+#include <bitset>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+
+class Data;
+class Reassembly;
+
+/**
+ * Limits the memory used by all Reassembly instances of a ToxTunCore.
+ * Remembers the sets of all instances in the order they were started,
+ * so the oldest ones can be evicted first.
+ */
+class ReassemblyBudget {
+	friend class Reassembly;
+
+	private:
+		/**
+		 * A started set of fragments.
+		 */
+		struct Entry {
+			Reassembly *reassembly; /**< Instance holding the set */
+			uint8_t splittedDataIndex; /**< Slot of the set */
+			uint32_t generation; /**< Generation of the slot when the set was started */
+		};
+
+		std::deque<Entry> sets; /**< Started sets, oldest first */
+		std::chrono::milliseconds timeout; /**< Time after which incomplete sets are dropped */
+		size_t connectionLimit; /**< Maximal bytes per Reassembly */
+		size_t totalLimit; /**< Maximal bytes of all Reassembly instances */
+		size_t totalBytes; /**< Bytes currently used by all Reassembly instances */
+		uint64_t evictions; /**< Incomplete sets dropped so far */
+
+		/**
+		 * Drops entries of sets that don't exist anymore from the front.
+		 */
+		void dropStale() noexcept;
+
+		/**
+		 * Evicts the oldest set of any Reassembly instance.
+		 * \return false if there is no set to evict
+		 */
+		bool evictOldest() noexcept;
+
+	public:
+		/**
+		 * Default timeout in milliseconds
+		 */
+		static constexpr uint32_t defaultTimeout = 1000;
+
+		/**
+		 * Default maximal bytes per connection
+		 */
+		static constexpr size_t defaultConnectionLimit = 256 * 1024;
+
+		/**
+		 * Default maximal bytes of all connections
+		 */
+		static constexpr size_t defaultTotalLimit = 4 * 1024 * 1024;
+
+		ReassemblyBudget() noexcept;
+
+		ReassemblyBudget(const ReassemblyBudget&) = delete; /**< Deleted */
+		ReassemblyBudget& operator=(const ReassemblyBudget&) = delete; /**< Deleted */
+
+		/**
+		 * Sets the limits.
+		 * Sets exceeding them are evicted as soon as new fragments arrive.
+		 * \param[in] timeout Milliseconds after which incomplete sets are dropped
+		 * \param[in] connectionLimit Maximal bytes per connection
+		 * \param[in] totalLimit Maximal bytes of all connections
+		 */
+		void setLimits(
+				uint32_t timeout,
+				size_t connectionLimit,
+				size_t totalLimit
+		) noexcept;
+
+		/**
+		 * Evicts all sets that are older than the timeout.
+		 */
+		void expire() noexcept;
+
+		/**
+		 * Gets the milliseconds until the oldest set times out.
+		 * \return std::numeric_limits<uint32_t>::max() if there is no
+		 * incomplete set
+		 * \sa expire()
+		 */
+		uint32_t getNextTimeout() noexcept;
+
+		/**
+		 * Gets the bytes currently used by all Reassembly instances.
+		 */
+		size_t getBytes() const noexcept;
+
+		/**
+		 * Gets the number of incomplete sets dropped so far.
+		 */
+		uint64_t getEvictions() const noexcept;
+};
+
+/**
+ * Reassembles fragmented packets received via tox.
+ * There is one slot for every splitted data index. The buffer of a slot
+ * is allocated with the first fragment of a set and every fragment is
+ * copied directly to its final position.
+ */
+class Reassembly {
+	friend class ReassemblyBudget;
+
+	private:
+		/**
+		 * State of one fragmented packet.
+		 */
+		struct Slot {
+			BufferRef buffer; /**< Reassembled packet */
+			size_t len; /**< Length of the packet, known once the last fragment arrived */
+			std::bitset<256> received; /**< Indices of received fragments */
+			std::chrono::steady_clock::time_point started; /**< Arrival of the first fragment */
+			uint32_t generation; /**< Incremented for every set started in this slot */
+			uint16_t receivedCount; /**< Number of bits set in received */
+			uint8_t fragmentsCount; /**< Fragments in the set, 0 if slot is unused */
+		};
+
+		ReassemblyBudget &budget; /**< Limits shared with other instances */
+		std::array<Slot, 256> slots; /**< One slot per splitted data index */
+		size_t bytes; /**< Bytes used by the buffers of all slots */
+
+		/**
+		 * Evicts sets until len more bytes fit into the limits.
+		 * \param[in] len Bytes needed
+		 * \param[in] keep Slot that must not be evicted
+		 * \return false if len bytes can't be made avaible
+		 */
+		bool makeRoom(size_t len, const Slot &keep) noexcept;
+
+		/**
+		 * Prepares the slot for a new set of fragments.
+		 * \return false if the limits or the memory don't allow it
+		 */
+		bool open(Slot &slot, uint8_t fragmentsCount) noexcept;
+
+		/**
+		 * Replaces the buffer of the slot by one with at least len bytes.
+		 * \return false if the limits or the memory don't allow it
+		 */
+		bool grow(Slot &slot, size_t len) noexcept;
+
+		/**
+		 * Frees the buffer of the slot and marks it unused.
+		 */
+		void reset(Slot &slot) noexcept;
+
+		/**
+		 * Resets the slot and counts it as eviction if it was in use.
+		 */
+		void evict(Slot &slot) noexcept;
+
+	public:
+		/**
+		 * \param[in] budget Limits shared with the other instances
+		 */
+		Reassembly(ReassemblyBudget &budget) noexcept;
+
+		Reassembly(const Reassembly&) = delete; /**< Deleted */
+		Reassembly& operator=(const Reassembly&) = delete; /**< Deleted */
+
+		/**
+		 * Frees all slots and removes them from the budget.
+		 */
+		~Reassembly();
+
+		/**
+		 * Copies the fragment to its slot.
+		 * Invalid and duplicated fragments are dropped.
+		 * \param[in] fragment Fragment for which Data::isValidFragment()
+		 * returns true
+		 * \param[out] complete Whether or not the packet the fragment
+		 * belongs to is complete
+		 * \return ToxTun::DropReason::None if the fragment was stored
+		 * \sa take()
+		 */
+		ToxTun::DropReason insert(const Data &fragment, bool &complete) noexcept;
+
+		/**
+		 * Removes the complete packet from its slot.
+		 * Must only be called after insert() set complete.
+		 */
+		Data take(uint8_t splittedDataIndex) noexcept;
+
+		/**
+		 * Drops the possibly incomplete packet in the slot.
+		 * Counts as eviction if the slot was in use.
+		 */
+		void clear(uint8_t splittedDataIndex) noexcept;
+};
+
+#endif //REASSEMBLY_HPP
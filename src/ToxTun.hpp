@@ -20,6 +20,7 @@
 
 /** \file */
 
+#include <cstddef>
 #include <cstdint>
 #include <exception>
 #include <string>
@@ -68,6 +69,83 @@ class ToxTun {
 			Disconnected
 		};
 
+		/**
+		 * Reasons for dropping a packet
+		 * \sa Statistics::drops
+		 */
+		enum class DropReason {
+			None, /**< Packet wasn't dropped */
+			OwnToxTraffic, /**< Frame was send by the own tox instance */
+			TunReadError, /**< Reading from the tun interface failed */
+			TunWriteError, /**< Writing to the tun interface failed */
+			ToxSendError, /**< Tox refused to send the packet */
+			PacketTooBig, /**< Packet can't be splitted into fragments */
+			NotConnected, /**< Data received while not connected */
+			UnknownFriend, /**< Packet received from a friend without connection */
+			InvalidPacket, /**< Packet received via tox is malformed */
+			InvalidFragment, /**< Fragment received via tox is malformed */
+			DuplicateFragment, /**< Fragment was received before */
+			ReassemblyLimit, /**< No memory left to reassemble the packet */
+			IcmpTooBig, /**< Frame too big for tox, answered with ICMP */
+			TunQueueFull, /**< Frames read by worker threads weren't handled in time */
+			NeighborAnswered, /**< ARP or neighbor solicitation for the friend answered locally */
+			Suppressed, /**< Broadcast or multicast over the limit of its class */
+			UnknownDestination, /**< Unicast read from the hub tun interface for no known friend */
+			NoMemory, /**< No memory left for the packet */
+			SpoofedSource, /**< Frame sent to the hub with an address of another friend */
+			Count /**< Number of drop reasons, not a reason itself */
+		};
+
+		/**
+		 * Classes of broadcast and multicast frames that can be limited.
+		 * ARP and IPv6 neighbor discovery are never limited.
+		 * \sa setTrafficLimit()
+		 */
+		enum class TrafficClass {
+			Mdns, /**< Multicast DNS */
+			Llmnr, /**< Link-Local Multicast Name Resolution */
+			Ssdp, /**< Simple Service Discovery Protocol */
+			NetBios, /**< NetBIOS name and datagram service */
+			RouterSolicitation, /**< ICMPv6 router solicitation */
+			Broadcast, /**< Any other broadcast */
+			Multicast, /**< Any other multicast */
+			Count /**< Number of traffic classes, not a class itself */
+		};
+
+		/**
+		 * Counters about the internal state of the library
+		 * \sa getStatistics()
+		 */
+		struct Statistics {
+			size_t buffersInUse; /**< Packet buffers currently in use */
+			size_t buffersAllocated; /**< Packet buffers owned by the pool */
+			size_t buffersHighWaterMark; /**< Maximum of buffersInUse */
+			size_t reassemblyBytes; /**< Bytes used to reassemble fragmented packets */
+			uint64_t reassemblyEvictions; /**< Incomplete fragmented packets dropped */
+			/**
+			 * Dropped packets, indexed by DropReason
+			 */
+			uint64_t drops[static_cast<size_t>(DropReason::Count)];
+			/**
+			 * Frames dropped by setTrafficLimit(), indexed by TrafficClass
+			 */
+			uint64_t suppressed[static_cast<size_t>(TrafficClass::Count)];
+		};
+
+		/**
+		 * Per connection information
+		 * \sa getConnectionStatistics()
+		 */
+		struct ConnectionStatistics {
+			uint16_t mtu; /**< MTU agreed with the friend, 0 if not connected */
+			/**
+			 * Whether or not the MTU could be set on the tun interface.
+			 * If not, frames bigger than a tox packet will be fragmented.
+			 */
+			bool mtuApplied;
+			bool layer3; /**< Whether or not IP packets are exchanged without ethernet header */
+		};
+
 		/**
 		 * Type for the callback function
 		 * \sa setCallback()
@@ -117,6 +195,26 @@ class ToxTun {
 		 */
 		virtual void iterate() noexcept = 0;
 
+		/**
+		 * Gets a file descriptor that becomes readable once iterate()
+		 * has frames to read from the tun interfaces.
+		 * Together with iterationInterval() this allows to sleep, e.g.
+		 * in poll(), until iterate() has work to do.
+		 * \return -1 if not avaible on this platform, call iterate()
+		 * as often as possible in this case
+		 * \sa iterationInterval()
+		 */
+		virtual int getFd() const noexcept = 0;
+
+		/**
+		 * Gets the milliseconds after which iterate() has to be called
+		 * again, even if the file descriptor doesn't become readable.
+		 * \return 0 if getFd() isn't avaible,
+		 * std::numeric_limits<uint32_t>::max() if there is no pending timer
+		 * \sa getFd()
+		 */
+		virtual uint32_t iterationInterval() noexcept = 0;
+
 		/**
 		 * Sends an connection Request to the friend.
 		 */
@@ -144,6 +242,131 @@ class ToxTun {
 		 * \param[in] friendNumber friend of whom to get the connection state
 		 */
 		virtual ConnectionState getConnectionState(uint32_t friendNumber) noexcept = 0;
+
+		/**
+		 * Get counters about the internal state of the library.
+		 */
+		virtual Statistics getStatistics() const noexcept = 0;
+
+		/**
+		 * Get information about the connection to friend.
+		 * \param[in] friendNumber friend of whom to get the information
+		 */
+		virtual ConnectionStatistics getConnectionStatistics(uint32_t friendNumber) noexcept = 0;
+
+		/**
+		 * Enables or disables path MTU discovery.
+		 * If enabled, IP packets too big for a single tox packet are
+		 * answered with an ICMP "fragmentation needed" or ICMPv6
+		 * "packet too big" message instead of being splitted into
+		 * fragments. Packets that can't be answered, e.g. IPv4 without
+		 * the don't fragment flag, are still fragmented.
+		 * Each answered packet is counted as DropReason::IcmpTooBig.
+		 * Disabled by default.
+		 */
+		virtual void setPathMtuDiscovery(bool enable) noexcept = 0;
+
+		/**
+		 * Enables or disables TCP MSS clamping.
+		 * If enabled, the MSS option of TCP SYN and SYN-ACK segments
+		 * read from the tun interface is lowered, so the friend never
+		 * sends TCP segments bigger than a single tox packet.
+		 * Only has full effect if the friend enables it, too.
+		 * Disabled by default.
+		 */
+		virtual void setMssClamping(bool enable) noexcept = 0;
+
+		/**
+		 * Sets how much iterate() reads from the tun interfaces.
+		 * Each call to iterate() reads frames until there are none left
+		 * or one of the budgets is used up. The budgets are shared by
+		 * all connections.
+		 * \param[in] packets Maximal number of frames, defaults to 256
+		 * \param[in] bytes Maximal number of bytes, defaults to 384 KiB
+		 */
+		virtual void setDrainBudget(size_t packets, size_t bytes) noexcept = 0;
+
+		/**
+		 * Sets the number of queues of tun interfaces created from now on.
+		 * With more than one queue, the kernel spreads the flows across
+		 * the queues and each queue is read by its own thread, so one
+		 * busy connection may use more than one core. Only supported on
+		 * linux. Defaults to 1, which doesn't start any thread.
+		 */
+		virtual void setTunQueues(size_t queues) noexcept = 0;
+
+		/**
+		 * Enables or disables offloading for tun interfaces created from now on.
+		 * If enabled, the kernel passes TCP super-frames of up to 64 KiB
+		 * instead of segmenting them, they are segmented into frames
+		 * fitting a single tox packet in userspace. Only supported on
+		 * linux. Disabled by default.
+		 */
+		virtual void setTunOffload(bool enable) noexcept = 0;
+
+		/**
+		 * Enables or disables layer 3 mode for connections established
+		 * from now on.
+		 * If enabled and supported by the friend, the tun interface
+		 * carries IP packets without ethernet header. This saves 14
+		 * bytes per packet and there is no ARP or neighbor discovery,
+		 * but only IP can be used over the connection. Only supported
+		 * on linux. Disabled by default.
+		 */
+		virtual void setTunLayer3(bool enable) noexcept = 0;
+
+		/**
+		 * Sets the number of tun interfaces kept open for new
+		 * connections.
+		 * That many interfaces are created right away with the
+		 * current options. Interfaces of closed connections are taken
+		 * down and kept instead of being destroyed, so connecting
+		 * doesn't have to create a new interface. Only supported on
+		 * linux. Defaults to 0, which keeps none.
+		 */
+		virtual void setTunPoolSize(size_t size) noexcept = 0;
+
+		/**
+		 * Enables or disables hub mode.
+		 * If enabled, all friends share a single tap interface with
+		 * one subnet, this side gets the address .1 and every friend
+		 * its own one. Frames are sent to the friend owning their
+		 * destination, broadcasts and multicasts to all friends. Hub
+		 * mode excludes layer 3 mode. Friends running an older version
+		 * of this library have to be called by the hub. Can only be
+		 * changed while there are no connections. Disabled by default.
+		 */
+		virtual void setHubMode(bool enable) noexcept = 0;
+
+		/**
+		 * Limits the frames of a broadcast or multicast class sent to
+		 * friends. Frames over the limit are dropped and counted in
+		 * Statistics::suppressed.
+		 * \param[in] trafficClass Class to limit
+		 * \param[in] framesPerSecond Frames of the class sent per second
+		 * and connection, 0 to drop all of them, UINT32_MAX (the
+		 * default) to send all of them
+		 */
+		virtual void setTrafficLimit(
+				TrafficClass trafficClass,
+				uint32_t framesPerSecond
+		) noexcept = 0;
+
+		/**
+		 * Sets the limits for reassembling fragmented packets.
+		 * If a limit is reached, the oldest incomplete packets are dropped
+		 * first. Each dropped packet is counted in
+		 * Statistics::reassemblyEvictions.
+		 * \param[in] timeout Milliseconds after which incomplete
+		 * packets are dropped
+		 * \param[in] connectionLimit Maximal bytes per connection
+		 * \param[in] totalLimit Maximal bytes of all connections
+		 */
+		virtual void setReassemblyLimits(
+				uint32_t timeout,
+				size_t connectionLimit,
+				size_t totalLimit
+		) noexcept = 0;
 };
 
 /**
@@ -86,6 +86,16 @@ void toxtun_iterate(void *toxtun) {
 	t->iterate();
 }
 
+int toxtun_get_fd(void *toxtun) {
+	ToxTun *t = reinterpret_cast<ToxTun *>(toxtun);
+	return t->getFd();
+}
+
+uint32_t toxtun_iteration_interval(void *toxtun) {
+	ToxTun *t = reinterpret_cast<ToxTun *>(toxtun);
+	return t->iterationInterval();
+}
+
 
 bool toxtun_send_connection_request(void *toxtun, uint32_t friendNumber) {
 	ToxTun *t = reinterpret_cast<ToxTun *>(toxtun);
@@ -141,6 +151,106 @@ enum toxtun_connection_state toxtun_get_connection_state(void *toxtun, uint32_t
 	}
 }
 
+void toxtun_get_statistics(void *toxtun, struct toxtun_statistics *statistics) {
+	ToxTun *t = reinterpret_cast<ToxTun *>(toxtun);
+	const ToxTun::Statistics s = t->getStatistics();
+
+	statistics->buffers_in_use = s.buffersInUse;
+	statistics->buffers_allocated = s.buffersAllocated;
+	statistics->buffers_high_water_mark = s.buffersHighWaterMark;
+	statistics->reassembly_bytes = s.reassemblyBytes;
+	statistics->reassembly_evictions = s.reassemblyEvictions;
+
+	static_assert(
+			static_cast<size_t>(ToxTun::DropReason::Count) == TOXTUN_DROP_REASON_COUNT,
+			"toxtun_drop_reason doesn't match ToxTun::DropReason"
+	);
+	for (size_t i = 0; i < TOXTUN_DROP_REASON_COUNT; ++i)
+		statistics->drops[i] = s.drops[i];
+
+	static_assert(
+			static_cast<size_t>(ToxTun::TrafficClass::Count) == TOXTUN_TRAFFIC_CLASS_COUNT,
+			"toxtun_traffic_class doesn't match ToxTun::TrafficClass"
+	);
+	for (size_t i = 0; i < TOXTUN_TRAFFIC_CLASS_COUNT; ++i)
+		statistics->suppressed[i] = s.suppressed[i];
+}
+
+void toxtun_get_connection_statistics(
+		void *toxtun,
+		uint32_t friendNumber,
+		struct toxtun_connection_statistics *statistics
+) {
+	ToxTun *t = reinterpret_cast<ToxTun *>(toxtun);
+	const ToxTun::ConnectionStatistics s = t->getConnectionStatistics(friendNumber);
+
+	statistics->mtu = s.mtu;
+	statistics->mtu_applied = s.mtuApplied;
+	statistics->layer3 = s.layer3;
+}
+
+void toxtun_set_path_mtu_discovery(void *toxtun, bool enable) {
+	ToxTun *t = reinterpret_cast<ToxTun *>(toxtun);
+	t->setPathMtuDiscovery(enable);
+}
+
+void toxtun_set_mss_clamping(void *toxtun, bool enable) {
+	ToxTun *t = reinterpret_cast<ToxTun *>(toxtun);
+	t->setMssClamping(enable);
+}
+
+void toxtun_set_drain_budget(void *toxtun, size_t packets, size_t bytes) {
+	ToxTun *t = reinterpret_cast<ToxTun *>(toxtun);
+	t->setDrainBudget(packets, bytes);
+}
+
+void toxtun_set_tun_queues(void *toxtun, size_t queues) {
+	ToxTun *t = reinterpret_cast<ToxTun *>(toxtun);
+	t->setTunQueues(queues);
+}
+
+void toxtun_set_tun_offload(void *toxtun, bool enable) {
+	ToxTun *t = reinterpret_cast<ToxTun *>(toxtun);
+	t->setTunOffload(enable);
+}
+
+void toxtun_set_tun_layer3(void *toxtun, bool enable) {
+	ToxTun *t = reinterpret_cast<ToxTun *>(toxtun);
+	t->setTunLayer3(enable);
+}
+
+void toxtun_set_tun_pool_size(void *toxtun, size_t size) {
+	ToxTun *t = reinterpret_cast<ToxTun *>(toxtun);
+	t->setTunPoolSize(size);
+}
+
+void toxtun_set_hub_mode(void *toxtun, bool enable) {
+	ToxTun *t = reinterpret_cast<ToxTun *>(toxtun);
+	t->setHubMode(enable);
+}
+
+void toxtun_set_traffic_limit(
+		void *toxtun,
+		enum toxtun_traffic_class trafficClass,
+		uint32_t framesPerSecond
+) {
+	ToxTun *t = reinterpret_cast<ToxTun *>(toxtun);
+	t->setTrafficLimit(
+			static_cast<ToxTun::TrafficClass>(trafficClass),
+			framesPerSecond
+	);
+}
+
+void toxtun_set_reassembly_limits(
+		void *toxtun,
+		uint32_t timeout,
+		size_t connectionLimit,
+		size_t totalLimit
+) {
+	ToxTun *t = reinterpret_cast<ToxTun *>(toxtun);
+	t->setReassemblyLimits(timeout, connectionLimit, totalLimit);
+}
+
 const char* toxtun_get_last_error(void *toxtun) {
 	static std::map<void*, std::unique_ptr<const char[]>> errorCStrings;
 
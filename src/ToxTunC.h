@@ -21,9 +21,12 @@
 /** \file */
 
 #ifdef __cplusplus
+#include <cstddef>
 #include <cstdint>
 extern "C" {
 #else
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #endif
 
@@ -57,6 +60,76 @@ enum toxtun_connection_state {
 	TOXTUN_CONNECTION_STATE_FRIEND_IS_RINGING
 };
 
+/**
+ * Reasons for dropping a packet
+ * \sa toxtun_statistics
+ * \sa ToxTun::DropReason
+ */
+enum toxtun_drop_reason {
+	TOXTUN_DROP_NONE,
+	TOXTUN_DROP_OWN_TOX_TRAFFIC,
+	TOXTUN_DROP_TUN_READ_ERROR,
+	TOXTUN_DROP_TUN_WRITE_ERROR,
+	TOXTUN_DROP_TOX_SEND_ERROR,
+	TOXTUN_DROP_PACKET_TOO_BIG,
+	TOXTUN_DROP_NOT_CONNECTED,
+	TOXTUN_DROP_UNKNOWN_FRIEND,
+	TOXTUN_DROP_INVALID_PACKET,
+	TOXTUN_DROP_INVALID_FRAGMENT,
+	TOXTUN_DROP_DUPLICATE_FRAGMENT,
+	TOXTUN_DROP_REASSEMBLY_LIMIT,
+	TOXTUN_DROP_ICMP_TOO_BIG,
+	TOXTUN_DROP_TUN_QUEUE_FULL,
+	TOXTUN_DROP_NEIGHBOR_ANSWERED,
+	TOXTUN_DROP_SUPPRESSED,
+	TOXTUN_DROP_UNKNOWN_DESTINATION,
+	TOXTUN_DROP_NO_MEMORY,
+	TOXTUN_DROP_SPOOFED_SOURCE,
+	TOXTUN_DROP_REASON_COUNT
+};
+
+/**
+ * Classes of broadcast and multicast frames that can be limited
+ * \sa toxtun_set_traffic_limit()
+ * \sa ToxTun::TrafficClass
+ */
+enum toxtun_traffic_class {
+	TOXTUN_TRAFFIC_MDNS,
+	TOXTUN_TRAFFIC_LLMNR,
+	TOXTUN_TRAFFIC_SSDP,
+	TOXTUN_TRAFFIC_NETBIOS,
+	TOXTUN_TRAFFIC_ROUTER_SOLICITATION,
+	TOXTUN_TRAFFIC_BROADCAST,
+	TOXTUN_TRAFFIC_MULTICAST,
+	TOXTUN_TRAFFIC_CLASS_COUNT
+};
+
+/**
+ * Counters about the internal state of the library
+ * \sa toxtun_get_statistics()
+ * \sa ToxTun::Statistics
+ */
+struct toxtun_statistics {
+	size_t buffers_in_use;
+	size_t buffers_allocated;
+	size_t buffers_high_water_mark;
+	size_t reassembly_bytes;
+	uint64_t reassembly_evictions;
+	uint64_t drops[TOXTUN_DROP_REASON_COUNT]; /**< Indexed by toxtun_drop_reason */
+	uint64_t suppressed[TOXTUN_TRAFFIC_CLASS_COUNT]; /**< Indexed by toxtun_traffic_class */
+};
+
+/**
+ * Information about a connection
+ * \sa toxtun_get_connection_statistics()
+ * \sa ToxTun::ConnectionStatistics
+ */
+struct toxtun_connection_statistics {
+	uint16_t mtu;
+	bool mtu_applied;
+	bool layer3;
+};
+
 /**
  * Creates a new ToxTun class.
  * \sa ToxTun::ToxTun().
@@ -91,6 +164,21 @@ void toxtun_set_callback(
  */
 void toxtun_iterate(void *toxtun);
 
+/**
+ * Gets a file descriptor that becomes readable once toxtun_iterate()
+ * has frames to read from the tun interfaces.
+ * \return -1 if not avaible
+ * \sa ToxTun::getFd()
+ */
+int toxtun_get_fd(void *toxtun);
+
+/**
+ * Gets the milliseconds after which toxtun_iterate() has to be called
+ * again, even if the file descriptor doesn't become readable.
+ * \sa ToxTun::iterationInterval()
+ */
+uint32_t toxtun_iteration_interval(void *toxtun);
+
 /**
  * Sends a connection request to friend.
  * \return false in case of error, true otherwise
@@ -124,6 +212,91 @@ void toxtun_close_connection(void *toxtun, uint32_t friendNumber);
  */
 enum toxtun_connection_state toxtun_get_connection_state(void *toxtun, uint32_t friendNumber);
 
+/**
+ * Get counters about the internal state of the library.
+ * \sa ToxTun::getStatistics()
+ */
+void toxtun_get_statistics(void *toxtun, struct toxtun_statistics *statistics);
+
+/**
+ * Get information about the connection to friend.
+ * \sa ToxTun::getConnectionStatistics()
+ */
+void toxtun_get_connection_statistics(
+		void *toxtun,
+		uint32_t friendNumber,
+		struct toxtun_connection_statistics *statistics
+);
+
+/**
+ * Enables or disables path MTU discovery.
+ * \sa ToxTun::setPathMtuDiscovery()
+ */
+void toxtun_set_path_mtu_discovery(void *toxtun, bool enable);
+
+/**
+ * Enables or disables TCP MSS clamping.
+ * \sa ToxTun::setMssClamping()
+ */
+void toxtun_set_mss_clamping(void *toxtun, bool enable);
+
+/**
+ * Sets how much toxtun_iterate() reads from the tun interfaces.
+ * \sa ToxTun::setDrainBudget()
+ */
+void toxtun_set_drain_budget(void *toxtun, size_t packets, size_t bytes);
+
+/**
+ * Sets the number of queues of tun interfaces created from now on.
+ * \sa ToxTun::setTunQueues()
+ */
+void toxtun_set_tun_queues(void *toxtun, size_t queues);
+
+/**
+ * Enables or disables offloading for tun interfaces created from now on.
+ * \sa ToxTun::setTunOffload()
+ */
+void toxtun_set_tun_offload(void *toxtun, bool enable);
+
+/**
+ * Enables or disables layer 3 mode for connections established from now on.
+ * \sa ToxTun::setTunLayer3()
+ */
+void toxtun_set_tun_layer3(void *toxtun, bool enable);
+
+/**
+ * Sets the number of tun interfaces kept open for new connections.
+ * \sa ToxTun::setTunPoolSize()
+ */
+void toxtun_set_tun_pool_size(void *toxtun, size_t size);
+
+/**
+ * Enables or disables hub mode.
+ * \sa ToxTun::setHubMode()
+ */
+void toxtun_set_hub_mode(void *toxtun, bool enable);
+
+/**
+ * Limits the frames of a broadcast or multicast class sent to friends.
+ * \sa ToxTun::setTrafficLimit()
+ */
+void toxtun_set_traffic_limit(
+		void *toxtun,
+		enum toxtun_traffic_class trafficClass,
+		uint32_t framesPerSecond
+);
+
+/**
+ * Sets the limits for reassembling fragmented packets.
+ * \sa ToxTun::setReassemblyLimits()
+ */
+void toxtun_set_reassembly_limits(
+		void *toxtun,
+		uint32_t timeout,
+		size_t connectionLimit,
+		size_t totalLimit
+);
+
 /**
  * Get humen readable description of last error.
  * \return Pointer to string, vaild until next call to get_last_error with the same toxtun instance as argument.
@@ -16,15 +16,41 @@
  */
 
 #include "ToxTunCore.hpp"
+#include "BufferPool.hpp"
 #include "Connection.hpp"
 #include "Logger.hpp"
+#include "PacketType.hpp"
 #include "Data.hpp"
 
-#include <chrono>
+#include <algorithm>
+#include <new>
+
+constexpr uint32_t ToxTunCore::hubPollerId;
+
+/**
+ * Whether or not a tun interface created with a can be used for b.
+ */
+static bool sameTunOptions(
+		const TunInterface::Options &a,
+		const TunInterface::Options &b
+) noexcept {
+	return a.queues == b.queues && a.offload == b.offload && a.layer3 == b.layer3;
+}
 
 ToxTunCore::ToxTunCore(Tox *tox) noexcept
 :
 	tox(tox),
+	drops(),
+	pathMtuDiscovery(false),
+	mssClamping(false),
+	drainPackets(256),
+	drainBytes(384 * 1024),
+	tunOptions({1, false, false}),
+	tunPoolSize(0),
+	hubMode(false),
+	hubSubnet(0),
+	hubMtu(0),
+	hubMtuApplied(false),
 	callbackUserData(nullptr),
 	callbackFunction(nullptr)
 {
@@ -42,6 +68,8 @@ ToxTunCore::ToxTunCore(Tox *tox) noexcept
 }
 
 ToxTunCore::~ToxTunCore() {
+	if (hubTun) poller.remove(*hubTun, hubPollerId);
+
 	tox_callback_friend_lossless_packet(tox, nullptr, nullptr);
 	tox_callback_friend_lossy_packet(tox, nullptr, nullptr);
 }
@@ -54,7 +82,15 @@ void ToxTunCore::toxPacketCallback(
 ) noexcept {
 	ToxTunCore *toxTun = reinterpret_cast<ToxTunCore *>(ToxTunCoreVoid);
 
-	Data data(Data::fromToxData(dataRaw, length));
+	Data data;
+	try {
+		data = Data::fromToxData(dataRaw, length);
+	} catch (std::bad_alloc &error) {
+		Logger::error("Can't allocate memory for packet from ", friendNumber);
+		toxTun->countDrop(ToxTun::DropReason::NoMemory);
+		return;
+	}
+
 	toxTun->handleData(data, friendNumber);
 }
 
@@ -64,15 +100,22 @@ void ToxTunCore::handleData(const Data &data, uint32_t friendNumber) noexcept {
 		return;
 	}
 
+	if (PacketType::validate(data) != ToxTun::DropReason::None) {
+		Logger::debug("Received invalid packet from not connected friend");
+		countDrop(ToxTun::DropReason::InvalidPacket);
+		return;
+	}
+
 	switch (data.getToxHeader()) {
 		case Data::PacketId::ConnectionRequest:
-			handleConnectionRequest(friendNumber);
+			handleConnectionRequest(friendNumber, data.getCapabilities());
 			break;
 		case Data::PacketId::ConnectionReset:
 			Logger::debug("Received ConnectionReset from not connected friend, ignoring");
 			break;
 		default:
 			Logger::debug("Received packet from not connected friend");
+			countDrop(ToxTun::DropReason::UnknownFriend);
 			Connection::resetConnection(friendNumber, tox);
 	}
 }
@@ -83,17 +126,129 @@ void ToxTunCore::setCallback(ToxTun::CallbackFunction callback, void *userData)
 }
 
 void ToxTunCore::iterate() noexcept {
+	reassemblyBudget.expire();
+
+	for (uint32_t friendNumber : flushFriends) {
+		auto connection = connections.find(friendNumber);
+		if (connection == connections.end()) continue;
+
+		connection->second.flushTun();
+	}
+	flushFriends.clear();
+
 	if (connections.empty()) return;
 
-	const auto timePerConnection = std::chrono::microseconds(
-			500 / connections.size() //Must be integer
+	poller.wait(readyFriends);
+	try {
+		for (uint32_t friendNumber : pendingFriends) {
+			if (std::find(readyFriends.begin(), readyFriends.end(), friendNumber) == readyFriends.end())
+				readyFriends.push_back(friendNumber);
+		}
+	} catch (std::bad_alloc &error) {
+		Logger::error("Can't add friends with pending frames");
+	}
+	pendingFriends.clear();
+	if (readyFriends.empty()) return;
+
+	const size_t packetsPerConnection = std::max<size_t>(
+			drainPackets / readyFriends.size(), 1
+	);
+	const size_t bytesPerConnection = std::max<size_t>(
+			drainBytes / readyFriends.size(), 1
 	);
 
-	for (auto &connection : connections)
-		connection.second.iterate(timePerConnection);
+	for (uint32_t friendNumber : readyFriends) {
+		if (friendNumber == hubPollerId) {
+			iterateHub(packetsPerConnection, bytesPerConnection);
+			continue;
+		}
+
+		//The connection may have been deleted in the meantime
+		auto connection = connections.find(friendNumber);
+		if (connection == connections.end()) continue;
+
+		connection->second.iterate(packetsPerConnection, bytesPerConnection);
+	}
+
+	for (uint32_t friendNumber : readyFriends) {
+		bool pending;
+		if (friendNumber == hubPollerId) {
+			pending = hubTun && hubTun->hasPending();
+		} else {
+			auto connection = connections.find(friendNumber);
+			pending = connection != connections.end() && connection->second.hasPendingFrames();
+		}
+
+		if (!pending) continue;
+
+		try {
+			pendingFriends.push_back(friendNumber);
+		} catch (std::bad_alloc &error) {
+			Logger::error("Can't remember pending frames of ", friendNumber);
+		}
+	}
 }
 
-void ToxTunCore::handleConnectionRequest(uint32_t friendNumber) noexcept {
+void ToxTunCore::iterateHub(size_t packetBudget, size_t byteBudget) noexcept {
+	hubTun->setMssClamp(mssClamping ? hubMtu : 0);
+
+	size_t packets = 0, bytes = 0;
+	while (packets < packetBudget && bytes < byteBudget) {
+		Data data;
+		const ToxTun::DropReason reason = hubTun->getData(data);
+		if (reason == ToxTun::DropReason::None && data.empty()) break;
+
+		++packets;
+		if (!data.empty()) bytes += data.getIpDataLen();
+		if (reason != ToxTun::DropReason::None) {
+			countDrop(reason);
+			continue;
+		}
+
+		if (
+				data.getToxDataLen() > TOX_MAX_CUSTOM_PACKET_SIZE &&
+				pathMtuDiscovery &&
+				hubTun->sendPacketTooBig(data, hubMtu)
+		) {
+			countDrop(ToxTun::DropReason::IcmpTooBig);
+			continue;
+		}
+
+		uint32_t friendNumber;
+		if (forwardingTable.lookup(data, friendNumber)) {
+			auto connection = connections.find(friendNumber);
+			if (
+					connection == connections.end() ||
+					connection->second.getConnectionState() != ToxTun::ConnectionState::Connected
+			) {
+				countDrop(ToxTun::DropReason::UnknownDestination);
+				continue;
+			}
+
+			connection->second.sendFrame(data);
+		} else if (data.getIpData()[0] & 0x01) {
+			//Broadcasts and multicasts are flooded to all friends
+			for (auto &connection : connections) {
+				if (connection.second.getConnectionState() == ToxTun::ConnectionState::Connected)
+					connection.second.sendFrame(data);
+			}
+		} else {
+			countDrop(ToxTun::DropReason::UnknownDestination);
+		}
+	}
+}
+
+int ToxTunCore::getFd() const noexcept {
+	return poller.getFd();
+}
+
+uint32_t ToxTunCore::iterationInterval() noexcept {
+	if (poller.getFd() < 0 || !flushFriends.empty() || !pendingFriends.empty()) return 0;
+
+	return reassemblyBudget.getNextTimeout();
+}
+
+void ToxTunCore::handleConnectionRequest(uint32_t friendNumber, uint8_t capabilities) noexcept {
 	Logger::debug("ConnectionRequest received from ", friendNumber);
 
 	if (!callbackFunction) {
@@ -105,7 +260,7 @@ void ToxTunCore::handleConnectionRequest(uint32_t friendNumber) noexcept {
 		connections.emplace(
 				std::piecewise_construct,
 				std::forward_as_tuple(friendNumber), 
-				std::forward_as_tuple(friendNumber, *this, false)
+				std::forward_as_tuple(friendNumber, *this, false, capabilities)
 		);
 	} catch (ToxTunError &error) {
 		connections.erase(friendNumber); //needed?
@@ -164,6 +319,231 @@ ToxTun::ConnectionState ToxTunCore::getConnectionState(uint32_t friendNumber) no
 	}
 }
 
+ToxTun::ConnectionStatistics ToxTunCore::getConnectionStatistics(uint32_t friendNumber) noexcept {
+	if (!connections.count(friendNumber)) {
+		return ToxTun::ConnectionStatistics();
+	} else {
+		return connections.at(friendNumber).getConnectionStatistics();
+	}
+}
+
+ToxTun::Statistics ToxTunCore::getStatistics() const noexcept {
+	ToxTun::Statistics statistics = {};
+
+	statistics.buffersInUse = BufferPool::getBuffersInUse();
+	statistics.buffersAllocated = BufferPool::getBuffersAllocated();
+	statistics.buffersHighWaterMark = BufferPool::getHighWaterMark();
+	statistics.reassemblyBytes = reassemblyBudget.getBytes();
+	statistics.reassemblyEvictions = reassemblyBudget.getEvictions();
+	for (size_t i = 0; i < static_cast<size_t>(ToxTun::DropReason::Count); ++i)
+		statistics.drops[i] = drops[i];
+	for (size_t i = 0; i < static_cast<size_t>(ToxTun::TrafficClass::Count); ++i)
+		statistics.suppressed[i] = trafficFilter.getSuppressed(static_cast<ToxTun::TrafficClass>(i));
+
+	return statistics;
+}
+
+void ToxTunCore::setPathMtuDiscovery(bool enable) noexcept {
+	pathMtuDiscovery = enable;
+}
+
+bool ToxTunCore::getPathMtuDiscovery() const noexcept {
+	return pathMtuDiscovery;
+}
+
+void ToxTunCore::setMssClamping(bool enable) noexcept {
+	mssClamping = enable;
+}
+
+bool ToxTunCore::getMssClamping() const noexcept {
+	return mssClamping;
+}
+
+void ToxTunCore::setDrainBudget(size_t packets, size_t bytes) noexcept {
+	drainPackets = packets;
+	drainBytes = bytes;
+}
+
+void ToxTunCore::setTunQueues(size_t queues) noexcept {
+	tunOptions.queues = queues ? queues : 1;
+}
+
+void ToxTunCore::setTunOffload(bool enable) noexcept {
+	tunOptions.offload = enable;
+}
+
+void ToxTunCore::setTunLayer3(bool enable) noexcept {
+	tunOptions.layer3 = enable;
+}
+
+void ToxTunCore::setTunPoolSize(size_t size) noexcept {
+	tunPoolSize = size;
+	if (tunPool.size() > size) tunPool.resize(size);
+
+	try {
+		tunPool.reserve(size);
+		while (tunPool.size() < size) {
+			tunPool.emplace_back(new Tun(tox, tunOptions));
+		}
+	} catch (ToxTunError &error) {
+		Logger::error("Can't fill tun interface pool: ", error.what());
+	} catch (std::bad_alloc &error) {
+		Logger::error("Can't fill tun interface pool: ", error.what());
+	}
+
+	Logger::debug(tunPool.size(), " tun interfaces in pool");
+}
+
+std::unique_ptr<Tun> ToxTunCore::createTun(const TunInterface::Options &options) {
+	auto pooled = std::find_if(
+			tunPool.begin(), tunPool.end(),
+			[&options](const std::unique_ptr<Tun> &tun) {
+				return sameTunOptions(tun->getOptions(), options);
+			}
+	);
+
+	if (pooled == tunPool.end()) return std::unique_ptr<Tun>(new Tun(tox, options));
+
+	std::unique_ptr<Tun> tun(std::move(*pooled));
+	tunPool.erase(pooled);
+	Logger::debug("Reusing tun interface from pool");
+
+	return tun;
+}
+
+void ToxTunCore::recycleTun(std::unique_ptr<Tun> tun) noexcept {
+	if (tunPool.size() >= tunPoolSize) return;
+
+	//Interfaces with outdated options are never taken again
+	TunInterface::Options options = tun->getOptions();
+	options.layer3 = tunOptions.layer3;
+	if (!sameTunOptions(options, tunOptions)) return;
+
+	if (!tun->recycle()) return;
+	tunPool.push_back(std::move(tun));
+}
+
+void ToxTunCore::setHubMode(bool enable) noexcept {
+	if (!connections.empty()) {
+		Logger::error("Hub mode can't be changed while there are connections");
+		return;
+	}
+
+	hubMode = enable;
+	if (!enable && hubTun) {
+		poller.remove(*hubTun, hubPollerId);
+		hubTun.reset();
+	}
+}
+
+bool ToxTunCore::getHubMode() const noexcept {
+	return hubMode;
+}
+
+Tun& ToxTunCore::getHubTun(uint16_t mtu) {
+	if (hubTun) return *hubTun;
+
+	TunInterface::Options options = tunOptions;
+	options.layer3 = false;
+	std::unique_ptr<Tun> tun(new Tun(tox, options));
+
+	int16_t subnet = 0;
+	for (; subnet < 256; ++subnet) {
+		bool unused;
+		try {
+			unused = tun->isAddrspaceUnused(subnet);
+		} catch (ToxTunError &error) {
+			Logger::error("Can't check if subnet is used, assuming it is not");
+			unused = true;
+		}
+
+		if (unused) break;
+	}
+	if (subnet == 256) throw ToxTunError("No free Ip subnet avaible");
+
+	hubMtuApplied = tun->configure(subnet, 1, mtu);
+	Logger::debug("Hub Ip set to 192.168.", static_cast<int>(subnet), ".1");
+
+	if (!hubMtuApplied) {
+		Logger::error("Can't set MTU, frames bigger than a tox packet will be fragmented");
+	}
+
+	tun->setTrafficFilter(&trafficFilter);
+	poller.add(*tun, hubPollerId);
+
+	hubSubnet = subnet;
+	hubMtu = mtu;
+	hubTun = std::move(tun);
+	return *hubTun;
+}
+
+uint8_t ToxTunCore::getHubSubnet() const noexcept {
+	return hubSubnet;
+}
+
+bool ToxTunCore::isHubMtuApplied() const noexcept {
+	return hubMtuApplied;
+}
+
+uint8_t ToxTunCore::allocateHubPostfix() noexcept {
+	//.1 is the hub itself, .255 the broadcast address
+	for (size_t postfix = 2; postfix < 255; ++postfix) {
+		if (!hubPostfixes[postfix]) {
+			hubPostfixes[postfix] = true;
+			return postfix;
+		}
+	}
+
+	return 0;
+}
+
+void ToxTunCore::releaseHubPostfix(uint8_t postfix) noexcept {
+	hubPostfixes[postfix] = false;
+}
+
+ForwardingTable& ToxTunCore::getForwardingTable() noexcept {
+	return forwardingTable;
+}
+
+void ToxTunCore::setTrafficLimit(
+		ToxTun::TrafficClass trafficClass,
+		uint32_t framesPerSecond
+) noexcept {
+	trafficFilter.setLimit(trafficClass, framesPerSecond);
+}
+
+TrafficFilter& ToxTunCore::getTrafficFilter() noexcept {
+	return trafficFilter;
+}
+
+const TunInterface::Options& ToxTunCore::getTunOptions() const noexcept {
+	return tunOptions;
+}
+
+void ToxTunCore::setReassemblyLimits(
+		uint32_t timeout,
+		size_t connectionLimit,
+		size_t totalLimit
+) noexcept {
+	reassemblyBudget.setLimits(timeout, connectionLimit, totalLimit);
+}
+
+void ToxTunCore::scheduleFlush(uint32_t friendNumber) {
+	flushFriends.push_back(friendNumber);
+}
+
+Poller& ToxTunCore::getPoller() noexcept {
+	return poller;
+}
+
+ReassemblyBudget& ToxTunCore::getReassemblyBudget() noexcept {
+	return reassemblyBudget;
+}
+
+void ToxTunCore::countDrop(ToxTun::DropReason reason) noexcept {
+	++drops[static_cast<size_t>(reason)];
+}
+
 void ToxTunCore::deleteConnection(uint32_t friendNumber) noexcept {
 	if (connections.erase(friendNumber) == 0) {
 		Logger::debug("No connection to delete for this friend");
@@ -21,8 +21,15 @@
 /** \file */
 
 #include "ToxTun.hpp"
+#include "ForwardingTable.hpp"
+#include "Poller.hpp"
+#include "Reassembly.hpp"
+#include "TrafficFilter.hpp"
 
+#include <bitset>
 #include <map>
+#include <memory>
+#include <vector>
 #include <tox/tox.h>
 
 class Data;
@@ -36,11 +43,99 @@ class ToxTunCore : public ToxTun {
 	private:
 		Tox *tox; /**< Tox struct passed to ToxTun::ToxTun() */
 
+		/**
+		 * Memory limits for reassembling fragmented packets.
+		 * Must outlive the connections.
+		 */
+		ReassemblyBudget reassemblyBudget;
+
+		/**
+		 * Readiness of the tun interfaces of the connections.
+		 * Must outlive the connections.
+		 */
+		Poller poller;
+
+		/**
+		 * Limits of broadcasts and multicasts sent to friends.
+		 * Must outlive the connections.
+		 */
+		TrafficFilter trafficFilter;
+
+		/**
+		 * Friends owning the addresses behind the hub tun interface.
+		 * Must outlive the connections.
+		 */
+		ForwardingTable forwardingTable;
+
+		/**
+		 * Tun interface shared by all connections in hub mode.
+		 * Created with the first connection, nullptr before.
+		 * Must outlive the connections.
+		 */
+		std::unique_ptr<Tun> hubTun;
+
+		/**
+		 * Tun interfaces kept open for new connections.
+		 * Must outlive the connections.
+		 */
+		std::vector<std::unique_ptr<Tun>> tunPool;
+
 		/**
 		 * Connections
 		 */
 		std::map<uint32_t, Connection> connections;
 
+		/**
+		 * Friends with pending frames, reused by iterate()
+		 */
+		std::vector<uint32_t> readyFriends;
+
+		/**
+		 * Friends whose frames weren't all read by the last iterate(),
+		 * the poller doesn't report them again
+		 */
+		std::vector<uint32_t> pendingFriends;
+
+		/**
+		 * Friends whose tun interface has to be flushed by iterate()
+		 */
+		std::vector<uint32_t> flushFriends;
+
+		/**
+		 * Dropped packets, indexed by ToxTun::DropReason
+		 */
+		uint64_t drops[static_cast<size_t>(ToxTun::DropReason::Count)];
+
+		/**
+		 * Whether or not oversized IP packets are answered with ICMP
+		 */
+		bool pathMtuDiscovery;
+
+		/**
+		 * Whether or not the MSS of TCP SYN segments is clamped
+		 */
+		bool mssClamping;
+
+		size_t drainPackets; /**< Frames read from tun per iterate() */
+		size_t drainBytes; /**< Bytes read from tun per iterate() */
+		TunInterface::Options tunOptions; /**< Options of new tun interfaces */
+		size_t tunPoolSize; /**< Maximal size of tunPool */
+
+		bool hubMode; /**< Whether or not all connections share hubTun */
+		uint8_t hubSubnet; /**< Subnet of hubTun */
+		uint16_t hubMtu; /**< MTU of hubTun */
+		bool hubMtuApplied; /**< Whether or not hubMtu is set on hubTun */
+
+		/**
+		 * Addresses in hubSubnet assigned to friends
+		 */
+		std::bitset<256> hubPostfixes;
+
+		/**
+		 * Id of hubTun in the poller, no valid friend number.
+		 */
+		static constexpr uint32_t hubPollerId = UINT32_MAX;
+
 		/**
 		 * User Data to be returned by the callback function
 		 */
@@ -68,9 +163,19 @@ class ToxTunCore : public ToxTun {
 
 		/**
 		 * Called by handleData
+		 * \param[in] capabilities Capabilities announced by friend
 		 * \sa handleData
 		 */
-		void handleConnectionRequest(uint32_t friendNumber) noexcept ;
+		void handleConnectionRequest(uint32_t friendNumber, uint8_t capabilities) noexcept ;
+
+		/**
+		 * Sends the frames read from hubTun to the friends owning their
+		 * destination until there are none left or one of the budgets
+		 * is used up.
+		 * \param[in] packetBudget Maximal number of frames to read
+		 * \param[in] byteBudget Bytes after which no further frame is read
+		 */
+		void iterateHub(size_t packetBudget, size_t byteBudget) noexcept;
 
 	public:
 		/**
@@ -105,6 +210,17 @@ class ToxTunCore : public ToxTun {
 		 */
 		virtual void iterate() noexcept final;
 
+		/**
+		 * Gets a file descriptor that becomes readable once iterate()
+		 * has frames to read.
+		 */
+		virtual int getFd() const noexcept final;
+
+		/**
+		 * Gets the milliseconds after which iterate() has to be called.
+		 */
+		virtual uint32_t iterationInterval() noexcept final;
+
 		/**
 		 * Sends an connection Request to the friend.
 		 */
@@ -131,6 +247,168 @@ class ToxTunCore : public ToxTun {
 		 */
 		virtual ToxTun::ConnectionState getConnectionState(uint32_t friendNumber) noexcept final;
 
+		/**
+		 * Get counters about the internal state of the library.
+		 */
+		virtual ToxTun::Statistics getStatistics() const noexcept final;
+
+		/**
+		 * Get information about the connection to friend.
+		 */
+		virtual ToxTun::ConnectionStatistics getConnectionStatistics(uint32_t friendNumber) noexcept final;
+
+		/**
+		 * Enables or disables path MTU discovery.
+		 */
+		virtual void setPathMtuDiscovery(bool enable) noexcept final;
+
+		/**
+		 * Enables or disables TCP MSS clamping.
+		 */
+		virtual void setMssClamping(bool enable) noexcept final;
+
+		/**
+		 * Sets how much iterate() reads from the tun interfaces.
+		 */
+		virtual void setDrainBudget(size_t packets, size_t bytes) noexcept final;
+
+		/**
+		 * Sets the number of queues of tun interfaces created from now on.
+		 */
+		virtual void setTunQueues(size_t queues) noexcept final;
+
+		/**
+		 * Enables or disables offloading for tun interfaces created from now on.
+		 */
+		virtual void setTunOffload(bool enable) noexcept final;
+
+		/**
+		 * Enables or disables layer 3 mode for connections established
+		 * from now on.
+		 */
+		virtual void setTunLayer3(bool enable) noexcept final;
+
+		/**
+		 * Sets the number of tun interfaces kept open and fills the
+		 * pool.
+		 */
+		virtual void setTunPoolSize(size_t size) noexcept final;
+
+		/**
+		 * Enables or disables hub mode if there are no connections.
+		 */
+		virtual void setHubMode(bool enable) noexcept final;
+
+		/**
+		 * Limits the frames of a broadcast or multicast class sent to
+		 * friends.
+		 */
+		virtual void setTrafficLimit(
+				ToxTun::TrafficClass trafficClass,
+				uint32_t framesPerSecond
+		) noexcept final;
+
+		/**
+		 * Sets the limits for reassembling fragmented packets.
+		 */
+		virtual void setReassemblyLimits(
+				uint32_t timeout,
+				size_t connectionLimit,
+				size_t totalLimit
+		) noexcept final;
+
+		/**
+		 * Get the memory limits shared by the connections.
+		 */
+		ReassemblyBudget& getReassemblyBudget() noexcept;
+
+		/**
+		 * Whether or not oversized IP packets should be answered with ICMP.
+		 */
+		bool getPathMtuDiscovery() const noexcept;
+
+		/**
+		 * Whether or not the MSS of TCP SYN segments should be clamped.
+		 */
+		bool getMssClamping() const noexcept;
+
+		/**
+		 * Get the filter the tun interfaces have to use.
+		 */
+		TrafficFilter& getTrafficFilter() noexcept;
+
+		/**
+		 * Whether or not all connections share the hub tun interface.
+		 */
+		bool getHubMode() const noexcept;
+
+		/**
+		 * Gets the hub tun interface, creates it if needed.
+		 * Throws ToxTunError if it can't be created.
+		 * \param[in] mtu MTU to set if the interface is created
+		 */
+		Tun& getHubTun(uint16_t mtu);
+
+		/**
+		 * Gets the subnet of the hub tun interface.
+		 */
+		uint8_t getHubSubnet() const noexcept;
+
+		/**
+		 * Whether or not the MTU is set on the hub tun interface.
+		 */
+		bool isHubMtuApplied() const noexcept;
+
+		/**
+		 * Reserves an address in the subnet of the hub tun interface.
+		 * \return Last byte of the address, 0 if all are in use
+		 */
+		uint8_t allocateHubPostfix() noexcept;
+
+		/**
+		 * Frees an address reserved by allocateHubPostfix().
+		 */
+		void releaseHubPostfix(uint8_t postfix) noexcept;
+
+		/**
+		 * Get the friends owning the addresses behind the hub tun
+		 * interface.
+		 */
+		ForwardingTable& getForwardingTable() noexcept;
+
+		/**
+		 * Get the readiness set the tun interfaces have to be added to.
+		 */
+		Poller& getPoller() noexcept;
+
+		/**
+		 * Gets the options new tun interfaces should use.
+		 */
+		const TunInterface::Options& getTunOptions() const noexcept;
+
+		/**
+		 * Gets a tun interface with the given options, taken from the
+		 * pool if there is one.
+		 * Throws ToxTunError if it can't be created.
+		 */
+		std::unique_ptr<Tun> createTun(const TunInterface::Options &options);
+
+		/**
+		 * Puts the tun interface of a closed connection back into the
+		 * pool, destroys it if the pool is full.
+		 */
+		void recycleTun(std::unique_ptr<Tun> tun) noexcept;
+
+		/**
+		 * Flush the tun interface of friend in the next iterate().
+		 */
+		void scheduleFlush(uint32_t friendNumber);
+
+		/**
+		 * Count a dropped packet.
+		 */
+		void countDrop(ToxTun::DropReason reason) noexcept;
+
 		/**
 		 * Delete connection to friend.
 		 */
@@ -0,0 +1,81 @@
+/* 
+ * Copyright (C) 2015 Johannes Schwab
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "TrafficFilter.hpp"
+
+#include <algorithm>
+
+constexpr uint32_t TrafficFilter::unlimited;
+
+TrafficFilter::Buckets::Buckets() noexcept
+:
+	tokens(),
+	refilled()
+{}
+
+TrafficFilter::TrafficFilter() noexcept
+:
+	suppressed(),
+	active(false)
+{
+	limits.fill(unlimited);
+}
+
+void TrafficFilter::setLimit(ToxTun::TrafficClass trafficClass, uint32_t framesPerSecond) noexcept {
+	if (trafficClass >= ToxTun::TrafficClass::Count) return;
+
+	limits[static_cast<size_t>(trafficClass)] = framesPerSecond;
+	active = std::any_of(limits.begin(), limits.end(), [](uint32_t limit) {
+		return limit != unlimited;
+	});
+}
+
+bool TrafficFilter::isActive() const noexcept {
+	return active;
+}
+
+bool TrafficFilter::pass(Buckets &buckets, ToxTun::TrafficClass trafficClass) noexcept {
+	if (trafficClass >= ToxTun::TrafficClass::Count) return true;
+
+	const size_t i = static_cast<size_t>(trafficClass);
+	const uint64_t limit = limits[i];
+	if (limit == unlimited) return true;
+
+	//The bucket holds the frames of one second
+	const auto now = std::chrono::steady_clock::now();
+	const uint64_t elapsed = std::min<std::chrono::milliseconds::rep>(
+			std::chrono::duration_cast<std::chrono::milliseconds>(
+				now - buckets.refilled[i]
+			).count(),
+			1000
+	);
+	buckets.tokens[i] = std::min(buckets.tokens[i] + elapsed * limit, limit * 1000);
+	buckets.refilled[i] = (elapsed < 1000) ?
+		buckets.refilled[i] + std::chrono::milliseconds(elapsed) : now;
+
+	if (buckets.tokens[i] < 1000) {
+		++suppressed[i];
+		return false;
+	}
+
+	buckets.tokens[i] -= 1000;
+	return true;
+}
+
+uint64_t TrafficFilter::getSuppressed(ToxTun::TrafficClass trafficClass) const noexcept {
+	return suppressed[static_cast<size_t>(trafficClass)];
+}
@@ -0,0 +1,109 @@
+/* 
+ * Copyright (C) 2015 Johannes Schwab
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRAFFIC_FILTER_HPP
+#define TRAFFIC_FILTER_HPP
+
+/** \file */
+
+#include "ToxTun.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+
+/**
+ * Limits the broadcast and multicast frames of each ToxTun::TrafficClass
+ * sent to friends.
+ * The limits and counters are shared by all connections of a ToxTunCore,
+ * every tun interface keeps its own TrafficFilter::Buckets.
+ */
+class TrafficFilter {
+	public:
+		/**
+		 * Limit that lets all frames of a class pass.
+		 */
+		static constexpr uint32_t unlimited = std::numeric_limits<uint32_t>::max();
+
+		/**
+		 * Token buckets of a single connection, one per class.
+		 */
+		struct Buckets {
+			/**
+			 * Thousandths of frames that may pass
+			 */
+			std::array<uint64_t, static_cast<size_t>(ToxTun::TrafficClass::Count)> tokens;
+
+			/**
+			 * Time the tokens were last refilled
+			 */
+			std::array<
+				std::chrono::steady_clock::time_point,
+				static_cast<size_t>(ToxTun::TrafficClass::Count)
+			> refilled;
+
+			Buckets() noexcept;
+		};
+
+	private:
+		/**
+		 * Frames per second, indexed by ToxTun::TrafficClass
+		 */
+		std::array<uint32_t, static_cast<size_t>(ToxTun::TrafficClass::Count)> limits;
+
+		/**
+		 * Dropped frames, indexed by ToxTun::TrafficClass
+		 */
+		std::array<uint64_t, static_cast<size_t>(ToxTun::TrafficClass::Count)> suppressed;
+
+		bool active; /**< Whether or not any class is limited */
+
+	public:
+		TrafficFilter() noexcept;
+
+		TrafficFilter(const TrafficFilter&) = delete; /**< Deleted */
+		TrafficFilter& operator=(const TrafficFilter&) = delete; /**< Deleted */
+
+		/**
+		 * Sets the frames per second of a class.
+		 * \param[in] framesPerSecond 0 drops all frames of the class,
+		 * unlimited lets all of them pass
+		 */
+		void setLimit(ToxTun::TrafficClass trafficClass, uint32_t framesPerSecond) noexcept;
+
+		/**
+		 * Whether or not any class is limited.
+		 * Frames don't need to be classified otherwise.
+		 */
+		bool isActive() const noexcept;
+
+		/**
+		 * Takes a token from the bucket of the class.
+		 * \param[in] trafficClass Class of the frame,
+		 * ToxTun::TrafficClass::Count if it isn't limited at all
+		 * \return false if the frame has to be dropped
+		 */
+		bool pass(Buckets &buckets, ToxTun::TrafficClass trafficClass) noexcept;
+
+		/**
+		 * Gets the number of dropped frames of a class.
+		 */
+		uint64_t getSuppressed(ToxTun::TrafficClass trafficClass) const noexcept;
+};
+
+#endif //TRAFFIC_FILTER_HPP
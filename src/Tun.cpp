@@ -15,19 +15,93 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "Checksum.hpp"
 #include "Data.hpp"
 #include "Logger.hpp"
 #include "Tun.hpp"
 #include "ToxTun.hpp"
 
+#include <algorithm>
+#include <cstring>
+#include <new>
 #include <sstream>
 #include <tox/tox.h>
 
-TunInterface::TunInterface(const Tox *tox)
+TunInterface::TunInterface(const Tox *tox, const Options &options)
 :
-	toxUdpPort(tox_self_get_udp_port(tox, nullptr))
+	options(options),
+	toxUdpPort(tox_self_get_udp_port(tox, nullptr)),
+	mssClampMtu(0),
+	peerMac(),
+	peerMacKnown(false),
+	peerIp4(),
+	trafficFilter(nullptr),
+	ipOffset(options.layer3 ? 0 : 14)
 {}
 
+constexpr size_t TunInterface::maxPeerIp6;
+
+/**
+ * Finds the upper layer header of an IPv6 packet behind its extension
+ * headers.
+ * \param[in] ip IPv6 header
+ * \param[in] len Bytes from ip on
+ * \param[out] protocol Next header value of the upper layer header
+ * \param[out] offset Offset of the upper layer header from ip
+ * \return false if the headers are truncated or the packet is a later
+ * fragment without upper layer header
+ */
+static bool skipIPv6ExtensionHeaders(
+		const uint8_t *ip,
+		size_t len,
+		uint8_t &protocol,
+		size_t &offset
+) noexcept {
+	if (len < 40) return false;
+	protocol = ip[6];
+	offset = 40;
+
+	while (true) {
+		switch (protocol) {
+			case 0: //Hop-by-hop options
+			case 43: //Routing
+			case 60: //Destination options
+				if (len < offset + 8) return false;
+				protocol = ip[offset];
+				offset += (ip[offset + 1] + 1) * 8;
+				break;
+			case 44: //Fragment
+				if (len < offset + 8) return false;
+				if (ip[offset + 2] | (ip[offset + 3] & 0xF8)) return false; //Not first fragment
+				protocol = ip[offset];
+				offset += 8;
+				break;
+			case 51: //Authentication header
+				if (len < offset + 8) return false;
+				protocol = ip[offset];
+				offset += (ip[offset + 1] + 2) * 4;
+				break;
+			default:
+				return offset <= len;
+		}
+	}
+}
+
+uint8_t TunInterface::getIpVersion(const uint8_t *frame, size_t len) const noexcept {
+	if (ipOffset == 0) {
+		if (len < 1) return 0;
+
+		const uint8_t version = frame[0] >> 4;
+		return (version == 4 || version == 6) ? version : 0;
+	}
+
+	if (len < ipOffset) return 0;
+	if (frame[12] == 0x08 && frame[13] == 0x00) return 4;
+	if (frame[12] == 0x86 && frame[13] == 0xDD) return 6;
+
+	return 0;
+}
+
 std::string TunInterface::ipv4FromPostfix(uint8_t subnet, uint8_t postfix) noexcept {
 	std::ostringstream ip;
 	
@@ -35,56 +109,403 @@ std::string TunInterface::ipv4FromPostfix(uint8_t subnet, uint8_t postfix) noexc
 	return ip.str();
 }
 
-Data TunInterface::getData() {
-	Data data = getDataBackend();
+ToxTun::DropReason TunInterface::getData(Data &data) noexcept {
+	const ToxTun::DropReason reason = getDataBackend(data);
+	if (reason != ToxTun::DropReason::None || data.empty()) return reason;
 
 	if (isFromOwnTox(data)) {
-		throw ToxTunError("Dropping packet from own tox instance", true);
+		Logger::debug("Dropping packet from own tox instance");
+		return ToxTun::DropReason::OwnToxTraffic;
+	}
+
+	if (ipOffset && peerMacKnown && answerNeighbor(data)) {
+		return ToxTun::DropReason::NeighborAnswered;
+	}
+
+	if (
+			trafficFilter && trafficFilter->isActive() &&
+			!trafficFilter->pass(trafficBuckets, classifyTraffic(data))
+	) {
+		Logger::debug("Dropping broadcast or multicast over its limit");
+		return ToxTun::DropReason::Suppressed;
 	}
 
-	return data;
+	if (mssClampMtu) clampMss(data);
+
+	return ToxTun::DropReason::None;
 }
 
-bool TunInterface::isFromOwnTox(const Data &data) noexcept {
-	if (data.getIpDataLen() < 14) return false;
+ToxTun::DropReason TunInterface::sendData(const Data &data) noexcept {
+	if (ipOffset) learnPeer(data);
+
+	return sendDataBackend(data);
+}
+
+void TunInterface::setTrafficFilter(TrafficFilter *filter) noexcept {
+	trafficFilter = filter;
+}
+
+ToxTun::TrafficClass TunInterface::classifyTraffic(const Data &frame) const noexcept {
+	constexpr ToxTun::TrafficClass unlimited = ToxTun::TrafficClass::Count;
+
+	const size_t len = frame.getIpDataLen();
+	const uint8_t *tmp = frame.getIpData();
+	const uint8_t *ip = tmp + ipOffset;
+	const uint8_t version = getIpVersion(tmp, len);
+
+	bool broadcast = false;
+	if (ipOffset) {
+		if (len < ipOffset || (tmp[0] & 0x01) == 0) return unlimited; //Unicast
+		if (tmp[12] == 0x08 && tmp[13] == 0x06) return unlimited; //ARP
+
+		static const uint8_t broadcastMac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+		broadcast = std::memcmp(tmp, broadcastMac, 6) == 0;
+	} else if (version == 4 && len >= 20) {
+		static const uint8_t limitedBroadcast[4] = {0xFF, 0xFF, 0xFF, 0xFF};
+		broadcast = std::memcmp(ip + 16, limitedBroadcast, 4) == 0 || (
+				peerIp4[0] && std::memcmp(ip + 16, peerIp4.data(), 3) == 0 &&
+				ip[19] == 0xFF
+		);
+		if (!broadcast && (ip[16] & 0xF0) != 0xE0) return unlimited;
+	} else if (version == 6 && len >= 40) {
+		if (ip[24] != 0xFF) return unlimited;
+	} else {
+		return unlimited;
+	}
+
+	const ToxTun::TrafficClass other = broadcast ?
+		ToxTun::TrafficClass::Broadcast : ToxTun::TrafficClass::Multicast;
+
+	size_t ipHeaderLength;
+	uint8_t protocol;
+	if (version == 4 && len >= ipOffset + 20) {
+		if ((ip[6] & 0x1F) | ip[7]) return other; //Not first fragment
+		ipHeaderLength = (ip[0] & 0x0F) * 4;
+		protocol = ip[9];
+	} else if (version == 6 && len >= ipOffset + 40) {
+		if (!skipIPv6ExtensionHeaders(ip, len - ipOffset, protocol, ipHeaderLength))
+			return other; //Truncated or not first fragment
+	} else {
+		return other;
+	}
+
+	if (len < ipOffset + ipHeaderLength + 8) return other;
+	const uint8_t *l4 = ip + ipHeaderLength;
+
+	if (protocol == 0x11) { //UDP
+		switch (static_cast<uint16_t>(l4[2]) << 8 | l4[3]) {
+			case 5353:
+				return ToxTun::TrafficClass::Mdns;
+			case 5355:
+				return ToxTun::TrafficClass::Llmnr;
+			case 1900:
+				return ToxTun::TrafficClass::Ssdp;
+			case 137:
+			case 138:
+				return ToxTun::TrafficClass::NetBios;
+		}
+	} else if (protocol == 58) { //ICMPv6
+		if (l4[0] == 133) return ToxTun::TrafficClass::RouterSolicitation;
+		if (l4[0] >= 134 && l4[0] <= 137) return unlimited; //Neighbor discovery
+	}
+
+	return other;
+}
+
+void TunInterface::forgetPeer() noexcept {
+	mssClampMtu = 0;
+	peerMacKnown = false;
+	peerIp4 = {};
+	peerIp6.clear();
+	trafficBuckets = TrafficFilter::Buckets();
+}
 
-	const uint8_t *tmp;
+const TunInterface::Options& TunInterface::getOptions() const noexcept {
+	return options;
+}
+
+bool TunInterface::hasPending() const noexcept {
+	return false;
+}
+
+void TunInterface::setPeerIp(uint8_t subnet, uint8_t postfix) noexcept {
+	peerIp4 = {{192, 168, subnet, postfix}};
+}
+
+void TunInterface::learnPeer(const Data &frame) noexcept {
+	const size_t len = frame.getIpDataLen();
+	const uint8_t *tmp = frame.getIpData();
+
+	//Interfaces shared by several friends have no single peer
+	if (!peerIp4[0]) return;
+	if (len < ipOffset || (tmp[6] & 0x01)) return; //Group addresses are no valid source
+
+	bool fromPeer = false;
+	const uint8_t *ip = tmp + ipOffset;
+
+	if (tmp[12] == 0x08 && tmp[13] == 0x06) { //ARP
+		fromPeer = len >= ipOffset + 28 &&
+			std::memcmp(ip + 14, peerIp4.data(), 4) == 0;
+	} else if (getIpVersion(tmp, len) == 4) {
+		fromPeer = len >= ipOffset + 20 &&
+			std::memcmp(ip + 12, peerIp4.data(), 4) == 0;
+	} else if (getIpVersion(tmp, len) == 6 && len >= ipOffset + 40) {
+		//Link local addresses are never routed, so they belong to friend
+		const uint8_t *source = ip + 8;
+		fromPeer = source[0] == 0xFE && (source[1] & 0xC0) == 0x80;
+
+		if (fromPeer && peerIp6.size() < maxPeerIp6) {
+			std::array<uint8_t, 16> address;
+			std::copy(source, source + 16, address.begin());
+			if (std::find(peerIp6.begin(), peerIp6.end(), address) == peerIp6.end())
+				peerIp6.push_back(address);
+		}
+	}
+
+	if (!fromPeer) return;
+	if (peerMacKnown && std::equal(peerMac.begin(), peerMac.end(), tmp + 6)) return;
+
+	std::copy(tmp + 6, tmp + 12, peerMac.begin());
+	peerMacKnown = true;
+	Logger::debug("Learned ethernet address of friend, answering its neighbor requests");
+}
+
+bool TunInterface::answerNeighbor(const Data &frame) noexcept {
+	const uint8_t *tmp = frame.getIpData();
+	if (frame.getIpDataLen() < ipOffset) return false;
+
+	if (tmp[12] == 0x08 && tmp[13] == 0x06)
+		return answerArp(frame);
+
+	if (getIpVersion(tmp, frame.getIpDataLen()) == 6)
+		return answerNeighborSolicitation(frame);
+
+	return false;
+}
+
+bool TunInterface::answerArp(const Data &frame) noexcept {
+	//Ethernet, IPv4, request
+	static const uint8_t arpRequest[8] = {0x00, 0x01, 0x08, 0x00, 6, 4, 0x00, 0x01};
+	constexpr size_t arpLength = 28;
+
+	if (!peerIp4[0] || frame.getIpDataLen() < ipOffset + arpLength) return false;
+
+	const uint8_t *arp = frame.getIpData() + ipOffset;
+	if (std::memcmp(arp, arpRequest, 8) != 0) return false;
+	if (std::memcmp(arp + 24, peerIp4.data(), 4) != 0) return false;
+
+	Data reply;
 	try {
-		tmp = data.getIpData();
-	} catch (ToxTunError &error) {
+		reply = Data::forTunData();
+	} catch (std::bad_alloc &error) {
 		return false;
 	}
+	uint8_t *out = reply.getTunBuffer();
 
-	if (tmp[12] == 0x08 && tmp[13] == 0x00)
-		return isFromOwnToxIPv4(data);
+	std::memcpy(out, arp + 8, 6);
+	std::copy(peerMac.begin(), peerMac.end(), out + 6);
+	out[12] = 0x08;
+	out[13] = 0x06;
 
-	if (tmp[12] == 0x86 && tmp[13] == 0xDD)
-		return isFromOwnToxIPv6(data);
+	uint8_t *outArp = out + ipOffset;
+	std::memcpy(outArp, arpRequest, 7);
+	outArp[7] = 0x02; //Reply
+	std::copy(peerMac.begin(), peerMac.end(), outArp + 8);
+	std::copy(peerIp4.begin(), peerIp4.end(), outArp + 14);
+	std::memcpy(outArp + 18, arp + 8, 10); //Sender of the request
 
-	return false;
+	reply.setIpDataLen(ipOffset + arpLength);
+
+	Logger::debug("Answering ARP request for friend");
+	return sendDataBackend(reply) == ToxTun::DropReason::None;
 }
 
-bool TunInterface::isFromOwnToxIPv4(const Data &data) noexcept {
-	constexpr uint8_t etherFrameOffset = 14;
+bool TunInterface::answerNeighborSolicitation(const Data &frame) noexcept {
+	constexpr size_t icmpOffset = 40;
+	constexpr size_t solicitationLength = 24;
+	constexpr size_t advertisementLength = 24 + 8;
+
+	const size_t len = frame.getIpDataLen();
+	if (len < ipOffset + icmpOffset + solicitationLength) return false;
+
+	const uint8_t *tmp = frame.getIpData();
+	const uint8_t *ip = tmp + ipOffset;
 
-	if (data.getIpDataLen() < etherFrameOffset + 10u) return false;
+	uint8_t protocol;
+	size_t solicitationOffset;
+	if (!skipIPv6ExtensionHeaders(ip, len - ipOffset, protocol, solicitationOffset)) return false;
+	if (protocol != 58 || ip[7] != 255) return false; //No ICMPv6 or routed
+	if (len < ipOffset + solicitationOffset + solicitationLength) return false;
 
-	const uint8_t *tmp;
+	const uint8_t *icmp = ip + solicitationOffset;
+	if (icmp[0] != 135 || icmp[1] != 0) return false; //No neighbor solicitation
+
+	std::array<uint8_t, 16> target;
+	std::copy(icmp + 8, icmp + 24, target.begin());
+	if (std::find(peerIp6.begin(), peerIp6.end(), target) == peerIp6.end()) return false;
+
+	//Duplicate address detection is answered to all nodes
+	static const uint8_t unspecified[16] = {};
+	static const uint8_t allNodes[16] = {0xFF, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01};
+	const bool solicited = std::memcmp(ip + 8, unspecified, 16) != 0;
+
+	Data reply;
 	try {
-		tmp = data.getIpData();
-	} catch (ToxTunError &error) {
+		reply = Data::forTunData();
+	} catch (std::bad_alloc &error) {
 		return false;
 	}
+	uint8_t *out = reply.getTunBuffer();
+
+	if (solicited) {
+		std::memcpy(out, tmp + 6, 6);
+	} else {
+		static const uint8_t allNodesMac[6] = {0x33, 0x33, 0, 0, 0, 0x01};
+		std::memcpy(out, allNodesMac, 6);
+	}
+	std::copy(peerMac.begin(), peerMac.end(), out + 6);
+	out[12] = 0x86;
+	out[13] = 0xDD;
+
+	uint8_t *outIp = out + ipOffset;
+	std::memset(outIp, 0, 8);
+	outIp[0] = 0x60;
+	outIp[5] = advertisementLength;
+	outIp[6] = 58; //ICMPv6
+	outIp[7] = 255; //Hop limit
+	std::copy(target.begin(), target.end(), outIp + 8);
+	std::memcpy(outIp + 24, solicited ? ip + 8 : allNodes, 16);
+
+	uint8_t *outIcmp = outIp + icmpOffset;
+	std::memset(outIcmp, 0, 8);
+	outIcmp[0] = 136; //Neighbor advertisement
+	outIcmp[4] = solicited ? 0x60 : 0x20; //Solicited and override flags
+	std::copy(target.begin(), target.end(), outIcmp + 8);
+	outIcmp[24] = 2; //Target link-layer address
+	outIcmp[25] = 1;
+	std::copy(peerMac.begin(), peerMac.end(), outIcmp + 26);
 
-	if (tmp[etherFrameOffset + 9] != 0x11) return false; //No UDP
+	const uint8_t pseudoHeader[8] = {0, 0, 0, advertisementLength, 0, 0, 0, 58};
+	uint32_t sum = Checksum::add(outIp + 8, 32);
+	sum = Checksum::add(pseudoHeader, 8, sum);
+	sum = Checksum::add(outIcmp, advertisementLength, sum);
+	Checksum::write(outIcmp + 2, Checksum::finish(sum));
 
-	if ((tmp[etherFrameOffset + 6] & 0x20) != 0) { //Fragmented
-		uint8_t f = (tmp[etherFrameOffset + 6] & 0x2F) | tmp[etherFrameOffset + 7];
+	reply.setIpDataLen(ipOffset + icmpOffset + advertisementLength);
+
+	Logger::debug("Answering neighbor solicitation for friend");
+	return sendDataBackend(reply) == ToxTun::DropReason::None;
+}
+
+void TunInterface::setMssClamp(uint16_t mtu) noexcept {
+	mssClampMtu = mtu;
+}
+
+void TunInterface::clampMss(Data &data) noexcept {
+	const size_t len = data.getIpDataLen();
+	if (len < ipOffset + 20) return;
+
+	uint8_t *tmp = data.getTunBuffer();
+	uint8_t *ip = tmp + ipOffset;
+
+	const uint8_t version = getIpVersion(tmp, len);
+	if (version == 4) {
+		const size_t ipHeaderLength = (ip[0] & 0x0F) * 4;
+		if (ipHeaderLength < 20 || len < ipOffset + ipHeaderLength) return;
+		if (ip[9] != 0x06) return; //No TCP
+		if ((ip[6] & 0x1F) | ip[7]) return; //Not first fragment
+		if (mssClampMtu <= 20 + 20) return; //No room for payload
+
+		clampMssTcp(
+				ip + ipHeaderLength,
+				len - ipOffset - ipHeaderLength,
+				mssClampMtu - 20 - 20
+		);
+	} else if (version == 6) {
+		uint8_t protocol;
+		size_t tcpOffset;
+		if (!skipIPv6ExtensionHeaders(ip, len - ipOffset, protocol, tcpOffset)) return;
+		if (protocol != 0x06) return; //No TCP
+		if (mssClampMtu <= 40 + 20) return; //No room for payload
+
+		clampMssTcp(ip + tcpOffset, len - ipOffset - tcpOffset, mssClampMtu - 40 - 20);
+	}
+}
+
+void TunInterface::clampMssTcp(uint8_t *tcp, size_t len, uint16_t mss) noexcept {
+	if (len < 20) return;
+	if ((tcp[13] & 0x02) == 0) return; //No SYN
+
+	const size_t tcpHeaderLength = (tcp[12] >> 4) * 4;
+	if (tcpHeaderLength < 20 || len < tcpHeaderLength) return;
+
+	size_t pos = 20;
+	while (pos < tcpHeaderLength) {
+		const uint8_t kind = tcp[pos];
+		if (kind == 0) return; //End of options
+		if (kind == 1) { //No operation
+			++pos;
+			continue;
+		}
+
+		if (pos + 1 >= tcpHeaderLength) return;
+		const uint8_t optionLength = tcp[pos + 1];
+		if (optionLength < 2 || pos + optionLength > tcpHeaderLength) return;
+
+		if (kind == 2 && optionLength == 4) {
+			const uint16_t oldMss = static_cast<uint16_t>(tcp[pos + 2]) << 8 | tcp[pos + 3];
+			if (oldMss <= mss) return;
+
+			//Options are only 8 bit aligned, so update every 16 bit word
+			//touched by the MSS, see RFC 1624
+			const size_t first = (pos + 2) & ~static_cast<size_t>(1);
+			const size_t last = (pos + 3) | 1;
+			uint32_t sum = static_cast<uint16_t>(~(
+					static_cast<uint16_t>(tcp[16]) << 8 | tcp[17]
+			));
+			for (size_t i = first; i < last; i += 2)
+				sum += static_cast<uint16_t>(~(static_cast<uint16_t>(tcp[i]) << 8 | tcp[i + 1]));
+
+			tcp[pos + 2] = mss >> 8;
+			tcp[pos + 3] = mss & 0xFF;
+
+			for (size_t i = first; i < last; i += 2)
+				sum += static_cast<uint16_t>(tcp[i]) << 8 | tcp[i + 1];
+			Checksum::write(tcp + 16, Checksum::finish(sum));
+
+			Logger::debug("Clamped TCP MSS from ", oldMss, " to ", mss);
+			return;
+		}
+
+		pos += optionLength;
+	}
+}
+
+bool TunInterface::isFromOwnTox(const Data &data) noexcept {
+	switch (getIpVersion(data.getIpData(), data.getIpDataLen())) {
+		case 4:
+			return isFromOwnToxIPv4(data);
+		case 6:
+			return isFromOwnToxIPv6(data);
+	}
+
+	return false;
+}
+
+bool TunInterface::isFromOwnToxIPv4(const Data &data) noexcept {
+	if (data.getIpDataLen() < ipOffset + 10u) return false;
+
+	const uint8_t *tmp = data.getIpData();
+
+	if (tmp[ipOffset + 9] != 0x11) return false; //No UDP
+
+	if ((tmp[ipOffset + 6] & 0x20) != 0) { //Fragmented
+		uint8_t f = (tmp[ipOffset + 6] & 0x2F) | tmp[ipOffset + 7];
 		if (f) return false; //Not first fragment, so no way to check source port
 	}
 
-	const uint8_t ipHeaderLength = (tmp[etherFrameOffset] & 0x0F) * 4;
-	const uint8_t ipDataOffset = etherFrameOffset + ipHeaderLength;
+	const uint8_t ipHeaderLength = (tmp[ipOffset] & 0x0F) * 4;
+	const uint8_t ipDataOffset = ipOffset + ipHeaderLength;
 	if (data.getIpDataLen() < ipDataOffset + 2u) return false;
 
 	uint16_t port = static_cast<uint16_t>(tmp[ipDataOffset]) << 8 | tmp[ipDataOffset + 1];
@@ -95,30 +516,24 @@ bool TunInterface::isFromOwnToxIPv4(const Data &data) noexcept {
 }
 
 bool TunInterface::isFromOwnToxIPv6(const Data &data) noexcept {
-	constexpr uint8_t etherFrameOffset = 14;
-	uint8_t ipDataOffset = etherFrameOffset + 40;
+	uint8_t ipDataOffset = ipOffset + 40;
 
 	if (data.getIpDataLen() < ipDataOffset) return false;
-	const uint8_t *tmp;
-	try {
-		tmp = data.getIpData();
-	} catch (ToxTunError &error) {
-		return false;
-	}
+	const uint8_t *tmp = data.getIpData();
 
 	//TODO This may also be another extension header, so deal with it
-	if (tmp[etherFrameOffset + 6] == 44u) { //Fragment
+	if (tmp[ipOffset + 6] == 44u) { //Fragment
 		if (data.getIpDataLen() < ipDataOffset + 10u) return false;
-		uint8_t f = tmp[etherFrameOffset + 42] | (tmp[etherFrameOffset + 43] & 0xF8);
+		uint8_t f = tmp[ipOffset + 42] | (tmp[ipOffset + 43] & 0xF8);
 		if (f) {
 			return false; //Not first fragment, so no way to check source port
 		} else {
 			//TODO This may also be another extension header, so deal with it
-			if (tmp[etherFrameOffset + 40] != 0x11) return false; //No UDP
+			if (tmp[ipOffset + 40] != 0x11) return false; //No UDP
 			ipDataOffset += 8;
 		}
 	} else {
-		if (tmp[etherFrameOffset + 6] != 0x11) return false; //No UDP
+		if (tmp[ipOffset + 6] != 0x11) return false; //No UDP
 	}
 
 	uint16_t port = static_cast<uint16_t>(tmp[ipDataOffset]) << 8 | tmp[ipDataOffset + 1];
@@ -128,6 +543,168 @@ bool TunInterface::isFromOwnToxIPv6(const Data &data) noexcept {
 	return false;
 }
 
+bool TunInterface::sendPacketTooBig(const Data &frame, uint16_t mtu) noexcept {
+	switch (getIpVersion(frame.getIpData(), frame.getIpDataLen())) {
+		case 4:
+			return sendPacketTooBigIPv4(frame, mtu);
+		case 6:
+			return sendPacketTooBigIPv6(frame, mtu);
+	}
+
+	return false;
+}
+
+bool TunInterface::sendPacketTooBigIPv4(const Data &frame, uint16_t mtu) noexcept {
+	const size_t icmpOffset = ipOffset + 20;
+
+	if (frame.getIpDataLen() < ipOffset + 20) return false;
+
+	const uint8_t *tmp = frame.getIpData();
+	const uint8_t *ip = tmp + ipOffset;
+	const size_t ipHeaderLength = (ip[0] & 0x0F) * 4;
+
+	if ((ip[0] >> 4) != 4 || ipHeaderLength < 20) return false;
+	if (frame.getIpDataLen() < ipOffset + ipHeaderLength + 8) return false;
+	if ((ip[6] & 0x40) == 0) return false; //May be fragmented
+	if ((ip[6] & 0x1F) | ip[7]) return false; //Not first fragment
+	if (ip[16] >= 224) return false; //Multicast or broadcast
+
+	if (ip[9] == 0x01) { //Never answer ICMP errors
+		const uint8_t type = ip[ipHeaderLength];
+		if (type == 3 || type == 4 || type == 5 || type == 11 || type == 12)
+			return false;
+	}
+
+	//Original header and the first 64 bits of its data
+	const size_t quoteLen = ipHeaderLength + 8;
+	const size_t ipLen = 20 + 8 + quoteLen;
+
+	Data reply;
+	try {
+		reply = Data::forTunData();
+	} catch (std::bad_alloc &error) {
+		return false;
+	}
+	uint8_t *out = reply.getTunBuffer();
+
+	if (ipOffset) {
+		std::memcpy(out, tmp + 6, 6);
+		std::memcpy(out + 6, tmp, 6);
+		out[12] = 0x08;
+		out[13] = 0x00;
+	}
+
+	uint8_t *outIp = out + ipOffset;
+	std::memset(outIp, 0, 20);
+	outIp[0] = 0x45;
+	outIp[2] = ipLen >> 8;
+	outIp[3] = ipLen & 0xFF;
+	outIp[8] = 64; //TTL
+	outIp[9] = 0x01; //ICMP
+	std::memcpy(outIp + 12, ip + 16, 4);
+	std::memcpy(outIp + 16, ip + 12, 4);
+	Checksum::write(outIp + 10, Checksum::finish(Checksum::add(outIp, 20)));
+
+	uint8_t *icmp = out + icmpOffset;
+	std::memset(icmp, 0, 8);
+	icmp[0] = 3; //Destination unreachable
+	icmp[1] = 4; //Fragmentation needed
+	icmp[6] = mtu >> 8;
+	icmp[7] = mtu & 0xFF;
+	std::memcpy(icmp + 8, ip, quoteLen);
+	Checksum::write(icmp + 2, Checksum::finish(Checksum::add(icmp, 8 + quoteLen)));
+
+	reply.setIpDataLen(icmpOffset + 8 + quoteLen);
+
+	Logger::debug("Answering IPv4 packet with fragmentation needed, MTU ", mtu);
+	return sendDataBackend(reply) == ToxTun::DropReason::None;
+}
+
+bool TunInterface::sendPacketTooBigIPv6(const Data &frame, uint16_t mtu) noexcept {
+	const size_t icmpOffset = ipOffset + 40;
+	constexpr size_t minMtu = 1280;
+
+	if (mtu < minMtu) return false; //Would be ignored
+	if (frame.getIpDataLen() < ipOffset + 40) return false;
+
+	const uint8_t *tmp = frame.getIpData();
+	const uint8_t *ip = tmp + ipOffset;
+
+	if ((ip[0] >> 4) != 6) return false;
+	if (ip[24] == 0xFF) return false; //Multicast
+
+	//Never answer ICMPv6 errors, they aren't fragmented
+	uint8_t protocol;
+	size_t l4Offset;
+	if (
+			skipIPv6ExtensionHeaders(ip, frame.getIpDataLen() - ipOffset, protocol, l4Offset) &&
+			protocol == 58
+	) {
+		if (frame.getIpDataLen() < ipOffset + l4Offset + 1) return false;
+		if (ip[l4Offset] < 128) return false;
+	}
+
+	//As much of the original packet as fits into the minimal MTU
+	const size_t quoteLen = std::min(
+			frame.getIpDataLen() - ipOffset,
+			minMtu - 40 - 8
+	);
+	const size_t payloadLen = 8 + quoteLen;
+
+	Data reply;
+	try {
+		reply = Data::forTunData();
+	} catch (std::bad_alloc &error) {
+		return false;
+	}
+	uint8_t *out = reply.getTunBuffer();
+
+	if (ipOffset) {
+		std::memcpy(out, tmp + 6, 6);
+		std::memcpy(out + 6, tmp, 6);
+		out[12] = 0x86;
+		out[13] = 0xDD;
+	}
+
+	uint8_t *outIp = out + ipOffset;
+	std::memset(outIp, 0, 8);
+	outIp[0] = 0x60;
+	outIp[4] = payloadLen >> 8;
+	outIp[5] = payloadLen & 0xFF;
+	outIp[6] = 58; //ICMPv6
+	outIp[7] = 64; //Hop limit
+	std::memcpy(outIp + 8, ip + 24, 16);
+	std::memcpy(outIp + 24, ip + 8, 16);
+
+	uint8_t *icmp = out + icmpOffset;
+	std::memset(icmp, 0, 8);
+	icmp[0] = 2; //Packet too big
+	icmp[6] = mtu >> 8;
+	icmp[7] = mtu & 0xFF;
+	std::memcpy(icmp + 8, ip, quoteLen);
+
+	const uint8_t pseudoHeader[8] = {
+		0, 0,
+		static_cast<uint8_t>(payloadLen >> 8),
+		static_cast<uint8_t>(payloadLen & 0xFF),
+		0, 0, 0, 58
+	};
+	uint32_t sum = Checksum::add(outIp + 8, 32);
+	sum = Checksum::add(pseudoHeader, 8, sum);
+	sum = Checksum::add(icmp, payloadLen, sum);
+	Checksum::write(icmp + 2, Checksum::finish(sum));
+
+	reply.setIpDataLen(icmpOffset + payloadLen);
+
+	Logger::debug("Answering IPv6 packet with packet too big, MTU ", mtu);
+	return sendDataBackend(reply) == ToxTun::DropReason::None;
+}
+
+bool TunInterface::configure(uint8_t subnet, uint8_t postfix, uint16_t mtu) noexcept {
+	setIp(subnet, postfix);
+	return setMtu(mtu);
+}
+
 bool TunInterface::isAddrspaceUnused(uint8_t addrSpace) {
 	std::list<std::array<uint8_t, 4>> usedIps = getUsedIp4Addresses();
 
@@ -20,6 +20,9 @@
 
 /** \file */
 
+#include "ToxTun.hpp"
+#include "TrafficFilter.hpp"
+
 #include <cstdint>
 #include <string>
 #include <vector>
@@ -33,8 +36,34 @@ class Tox;
  * Abstract Tun interface class
  */
 class TunInterface {
+	public:
+		/**
+		 * Options for creating a tun interface.
+		 * Backends ignore the options they don't support.
+		 */
+		struct Options {
+			size_t queues; /**< Queues, each read by its own thread if bigger than 1 */
+			bool offload; /**< Read GSO super-frames and segment them in userspace */
+			bool layer3; /**< Carry IP packets without ethernet header */
+		};
+
 	private:
+		const Options options; /**< Options the interface was created with */
 		const uint16_t toxUdpPort; /**< UDP port used by local tox instance */
+		uint16_t mssClampMtu; /**< MTU to clamp the TCP MSS to, 0 if disabled */
+
+		/**
+		 * Maximal number of link local IPv6 addresses learned from friend.
+		 */
+		static constexpr size_t maxPeerIp6 = 4;
+
+		std::array<uint8_t, 6> peerMac; /**< Ethernet address of friend */
+		bool peerMacKnown; /**< Whether or not peerMac was learned yet */
+		std::array<uint8_t, 4> peerIp4; /**< IPv4 of friend, 0.0.0.0 if not set */
+		std::vector<std::array<uint8_t, 16>> peerIp6; /**< Link local IPv6 of friend */
+
+		TrafficFilter *trafficFilter; /**< Limits broadcasts and multicasts, may be nullptr */
+		TrafficFilter::Buckets trafficBuckets; /**< Token buckets of this interface */
 
 		/**
 		 * Check wether or not an ethernet frame is send from the own tox instance
@@ -53,7 +82,77 @@ class TunInterface {
 		 */
 		bool isFromOwnToxIPv6(const Data &data) noexcept;
 
+		/**
+		 * Get the class of a broadcast or multicast frame.
+		 * \return ToxTun::TrafficClass::Count for unicast frames and
+		 * frames that are never limited, like ARP
+		 */
+		ToxTun::TrafficClass classifyTraffic(const Data &frame) const noexcept;
+
+		/**
+		 * Learn the ethernet and IPv6 addresses of friend from a frame
+		 * sent by friend.
+		 */
+		void learnPeer(const Data &frame) noexcept;
+
+		/**
+		 * Answer an ARP request or neighbor solicitation for friend
+		 * without sending it over tox.
+		 * \return false if frame isn't answered
+		 */
+		bool answerNeighbor(const Data &frame) noexcept;
+
+		/**
+		 * Called by answerNeighbor()
+		 * \sa answerNeighbor()
+		 */
+		bool answerArp(const Data &frame) noexcept;
+
+		/**
+		 * Called by answerNeighbor()
+		 * \sa answerNeighbor()
+		 */
+		bool answerNeighborSolicitation(const Data &frame) noexcept;
+
+		/**
+		 * Lower the MSS option of a TCP SYN segment to fit mssClampMtu.
+		 * \sa setMssClamp()
+		 */
+		void clampMss(Data &data) noexcept;
+
+		/**
+		 * Called by clampMss()
+		 * \param[in] tcp Start of the TCP header
+		 * \param[in] len Bytes avaible from tcp on
+		 * \param[in] mss Maximal MSS
+		 */
+		static void clampMssTcp(uint8_t *tcp, size_t len, uint16_t mss) noexcept;
+
+		/**
+		 * Called by sendPacketTooBig()
+		 * \sa sendPacketTooBig()
+		 */
+		bool sendPacketTooBigIPv4(const Data &frame, uint16_t mtu) noexcept;
+
+		/**
+		 * Called by sendPacketTooBig()
+		 * \sa sendPacketTooBig()
+		 */
+		bool sendPacketTooBigIPv6(const Data &frame, uint16_t mtu) noexcept;
+
 	protected:
+		/**
+		 * Offset of the IP header in frames.
+		 * 14 behind an ethernet header, 0 in layer 3 mode.
+		 */
+		const size_t ipOffset;
+
+		/**
+		 * Gets the IP version of frame.
+		 * \return 4 or 6, 0 if frame isn't an IP packet
+		 */
+		uint8_t getIpVersion(const uint8_t *frame, size_t len) const noexcept;
+
 		/**
 		 * Generate IPv4 Address from postfix.
 		 * \param[in] postfix postfix to use
@@ -64,14 +163,37 @@ class TunInterface {
 		/**
 		 * Get data from tun interface.
 		 * Called by getData()
+		 * Must not block, data is left untouched if there is nothing
+		 * to read.
+		 * \param[out] data Packet the frame is stored in
+		 * \return ToxTun::DropReason::None on success
 		 * \sa getData()
 		 */
-		virtual Data getDataBackend() = 0;
+		virtual ToxTun::DropReason getDataBackend(Data &data) noexcept = 0;
+
+		/**
+		 * Send data to tun interface.
+		 * Called by sendData()
+		 * \return ToxTun::DropReason::None on success
+		 * \sa sendData()
+		 */
+		virtual ToxTun::DropReason sendDataBackend(const Data &data) noexcept = 0;
 
 		virtual std::list<std::array<uint8_t, 4>> getUsedIp4Addresses() = 0;
 
+		/**
+		 * Forget everything learned about friend.
+		 * Called by recycle()
+		 */
+		void forgetPeer() noexcept;
+
 	public:
-		TunInterface(const Tox *tox);
+		/**
+		 * \param[in] options Options the backend created the interface
+		 * with, Options::layer3 if frames are IP packets without
+		 * ethernet header
+		 */
+		TunInterface(const Tox *tox, const Options &options);
 
 		TunInterface(const TunInterface&) = delete; /**< Deleted */
 		TunInterface& operator=(const TunInterface&) = delete; /**< Deleted */
@@ -82,30 +204,100 @@ class TunInterface {
 		virtual void setIp(uint8_t subnet, uint8_t postfix) noexcept = 0;
 
 		/**
-		 * Indicates wether or not there is pending data to be
-		 * read from tun interface.
-		 * \return true if there is pending data, false otherwise
+		 * Set the MTU of tun interface
+		 * \return true on success, false otherwise
+		 */
+		virtual bool setMtu(uint16_t mtu) noexcept = 0;
+
+		/**
+		 * Set IP and MTU of tun interface.
+		 * Backends may do this in a single step, by default setIp()
+		 * and setMtu() are called.
+		 * \return true if the MTU was set, false otherwise
+		 */
+		virtual bool configure(uint8_t subnet, uint8_t postfix, uint16_t mtu) noexcept;
+
+		/**
+		 * Set the IPv4 of friend.
+		 * ARP requests for it are answered locally once the ethernet
+		 * address of friend is known.
+		 */
+		void setPeerIp(uint8_t subnet, uint8_t postfix) noexcept;
+
+		/**
+		 * Limit broadcasts and multicasts read by getData().
+		 * \param[in] filter Filter to use, nullptr to disable limiting
 		 */
-		virtual bool dataPending() = 0;
+		void setTrafficFilter(TrafficFilter *filter) noexcept;
+
+		/**
+		 * Clamp the MSS of TCP SYN segments read by getData() to the
+		 * given MTU.
+		 * \param[in] mtu MTU to clamp to, 0 to disable clamping
+		 */
+		void setMssClamp(uint16_t mtu) noexcept;
 
 		/**
 		 * Get data from tun interface.
-		 * May ether throw an error or lock if there isn't any data to read.
-		 * \sa dataPending()
+		 * Doesn't block, data is left empty if there isn't any data
+		 * to read.
+		 * \param[out] data Packet the frame is stored in, must be empty
+		 * \return ToxTun::DropReason::None on success or if there was
+		 * nothing to read, the reason why the frame was dropped otherwise
+		 * \sa Data::empty()
 		 */
-		Data getData();
+		ToxTun::DropReason getData(Data &data) noexcept;
 
 		/**
-		 * Send data to tun interface.
-		 * Throws an error in case of failure.
+		 * Send data received from friend to tun interface.
+		 * \return ToxTun::DropReason::None on success
+		 */
+		ToxTun::DropReason sendData(const Data &data) noexcept;
+
+		/**
+		 * Writes frames buffered by sendData() to tun interface.
+		 * Backends may merge consecutive TCP segments passed to
+		 * sendData() into one super-frame, flush() has to be called
+		 * regularly to pass them on.
+		 * \return ToxTun::DropReason::None on success
+		 */
+		virtual ToxTun::DropReason flush() noexcept = 0;
+
+		/**
+		 * Prepares the interface to be used for another friend.
+		 * Takes it down, removes its addresses and drops all frames
+		 * that weren't read yet.
+		 * \return false if the interface can't be reused
+		 */
+		virtual bool recycle() noexcept = 0;
+
+		/**
+		 * Whether or not frames were already read from the interface
+		 * but not returned by getData() yet.
+		 * Those don't make the file descriptor readable again.
+		 */
+		virtual bool hasPending() const noexcept;
+
+		/**
+		 * Gets the options the interface was created with.
+		 */
+		const Options& getOptions() const noexcept;
+
+		/**
+		 * Answer an IP packet read from tun interface with an ICMP
+		 * "fragmentation needed" or ICMPv6 "packet too big" message.
+		 * \param[in] frame Frame that is too big
+		 * \param[in] mtu MTU to announce
+		 * \return false if the frame can't be answered, e.g. because it
+		 * isn't IP or the don't fragment flag is unset
 		 */
-		virtual void sendData(const Data &data) = 0;
+		bool sendPacketTooBig(const Data &frame, uint16_t mtu) noexcept;
 
 		/**
 		 * Wether or not the addressspace 192.168.<addrSpace>.0 is allready used.
 		 * Throws an error if the addresses can't be determined.
 		 */
-		bool isAddrspaceUnused(uint8_t addrSpace);
+		virtual bool isAddrspaceUnused(uint8_t addrSpace);
 };
 
 #ifdef __unix
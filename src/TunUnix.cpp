@@ -18,7 +18,9 @@
 #ifdef __unix
 
 #include "TunUnix.hpp"
+#include "Checksum.hpp"
 #include "Logger.hpp"
+#include "Netlink.hpp"
 #include "Data.hpp"
 #include "ToxTun.hpp"
 
@@ -33,12 +35,70 @@
 #include <fcntl.h>
 #include <cstring>
 #include <cerrno>
+#include <utility>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <new>
+#include <system_error>
 #include <tox/tox.h>
 
-TunUnix::TunUnix(const Tox *tox)
+constexpr size_t TunUnix::maxHandoff;
+constexpr int TunUnix::maxReadBackoff;
+constexpr bool TunUnix::layer3Supported;
+
+/**
+ * Header in front of every frame if IFF_VNET_HDR is set.
+ * Mirrors struct virtio_net_hdr, as linux/virtio_net.h can't be
+ * included from C++.
+ */
+struct VirtioNetHeader {
+	uint8_t flags;
+	uint8_t gsoType;
+	uint16_t headerLength;
+	uint16_t gsoSize;
+	uint16_t checksumStart;
+	uint16_t checksumOffset;
+};
+
+static constexpr uint8_t virtioNeedsChecksum = 1; /**< virtioNeedsChecksum */
+static constexpr uint8_t virtioGsoNone = 0; /**< virtioGsoNone */
+static constexpr uint8_t virtioGsoTcpV4 = 1; /**< virtioGsoTcpV4 */
+static constexpr uint8_t virtioGsoTcpV6 = 4; /**< virtioGsoTcpV6 */
+static constexpr uint8_t virtioGsoEcn = 0x80; /**< VIRTIO_NET_HDR_GSO_ECN */
+
+const size_t TunUnix::superFrameBufferLen = sizeof(VirtioNetHeader) + 14 + 65535;
+
+/**
+ * Reads a 16 bit value in network byte order.
+ */
+static uint16_t get16(const uint8_t *pos) noexcept {
+	return static_cast<uint16_t>(pos[0]) << 8 | pos[1];
+}
+
+/**
+ * Writes a 16 bit value in network byte order.
+ */
+static void put16(uint8_t *pos, uint16_t value) noexcept {
+	pos[0] = value >> 8;
+	pos[1] = value & 0xFF;
+}
+
+TunUnix::TunUnix(const Tox *tox, const Options &options)
 :
-	TunInterface(tox),
-	fd(open("/dev/net/tun", O_RDWR))
+	TunInterface(tox, options),
+	fd(open("/dev/net/tun", O_RDWR | O_NONBLOCK)),
+	wakeFd(-1),
+	stopFd(-1),
+	handoffDrops(0),
+	readErrors(0),
+	offload(options.offload),
+	coalesceLen(0),
+	coalesceSegments(0),
+	coalesceSegmentSize(0),
+	coalesceTcpOffset(0),
+	coalesceNextSeq(0)
 {
 	if (fd < 0) {
 		const char *errStr = std::strerror(errno);
@@ -47,7 +107,9 @@ TunUnix::TunUnix(const Tox *tox)
 
 	struct ifreq ifr = {}; //{} initializes ifr with 0
 
-	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	ifr.ifr_flags = (options.layer3 ? IFF_TUN : IFF_TAP) | IFF_NO_PI;
+	if (options.queues > 1) ifr.ifr_flags |= IFF_MULTI_QUEUE;
+	if (offload) ifr.ifr_flags |= IFF_VNET_HDR;
 
 	if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
 		std::string errStr(std::strerror(errno));
@@ -57,10 +119,37 @@ TunUnix::TunUnix(const Tox *tox)
 
 	name = ifr.ifr_name;
 
-	Logger::debug("Succesfully opened TAP device \"", ifr.ifr_name, "\"");
+	if (offload) {
+		superFrameBuffer.resize(superFrameBufferLen);
+		coalesceBuffer.resize(superFrameBufferLen);
+
+		//Without offloads the kernel still sends the header, just no super-frames
+		const unsigned int offloads = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6;
+		if (ioctl(fd, TUNSETOFFLOAD, offloads) < 0) {
+			const char *errStr = std::strerror(errno);
+			Logger::error("Can't enable offloading: ", errStr);
+		}
+	}
+
+	if (options.queues > 1) {
+		try {
+			startQueues(options.queues, ifr.ifr_flags);
+		} catch (ToxTunError &error) {
+			stopQueues();
+			close(fd);
+			throw;
+		}
+	}
+
+	Logger::debug(
+			"Succesfully opened ", options.layer3 ? "TUN" : "TAP",
+			" device \"", ifr.ifr_name, "\""
+	);
 }
 
 TunUnix::~TunUnix() {
+	flush();
+	stopQueues();
 	shutdown();
 	if (fd >= 0) close(fd);
 }
@@ -94,12 +183,6 @@ void TunUnix::setIp(uint8_t subnet, uint8_t postfix) noexcept {
 		Logger::error("Please set netmask to 255.255.255.0 manually");
 	}
 
-	ifr.ifr_mtu = TOX_MAX_CUSTOM_PACKET_SIZE - 18 - 1;
-	if (ioctl(fd, SIOCSIFMTU, &ifr) < 0) {
-		const char *errStr = std::strerror(errno);
-		Logger::debug("Can't set MTU: ", errStr);
-	}
-
 	if (ioctl(fd, SIOCGIFFLAGS, &ifr) < 0) {
 		const char *errStr = std::strerror(errno);
 		Logger::error("Getting socket flags with ioctl failed: ", errStr);
@@ -120,6 +203,45 @@ void TunUnix::setIp(uint8_t subnet, uint8_t postfix) noexcept {
 	close(fd);
 }
 
+bool TunUnix::setMtu(uint16_t mtu) noexcept {
+	struct ifreq ifr = {};
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		const char *errStr = std::strerror(errno);
+		Logger::error("Can't open socket to set MTU: ", errStr);
+		return false;
+	}
+
+	strncpy(ifr.ifr_name, name.c_str(), IFNAMSIZ);
+	ifr.ifr_mtu = mtu;
+
+	const bool success = ioctl(fd, SIOCSIFMTU, &ifr) >= 0;
+	if (!success) {
+		const char *errStr = std::strerror(errno);
+		Logger::error("Setting MTU to ", mtu, " with ioctl failed: ", errStr);
+	} else {
+		Logger::debug("MTU set to ", mtu);
+	}
+
+	close(fd);
+	return success;
+}
+
+bool TunUnix::configure(uint8_t subnet, uint8_t postfix, uint16_t mtu) noexcept {
+	bool mtuApplied;
+	if (Netlink::configure(name, subnet, postfix, mtu, mtuApplied)) return mtuApplied;
+
+	return TunInterface::configure(subnet, postfix, mtu);
+}
+
+bool TunUnix::isAddrspaceUnused(uint8_t addrSpace) {
+	bool used;
+	if (Netlink::isSubnetUsed(addrSpace, used)) return !used;
+
+	return TunInterface::isAddrspaceUnused(addrSpace);
+}
+
 std::list<std::array<uint8_t, 4>> TunUnix::getUsedIp4Addresses() {
 	std::list<std::array<uint8_t, 4>> list;
 	struct ifaddrs *ifaddr;
@@ -145,7 +267,7 @@ std::list<std::array<uint8_t, 4>> TunUnix::getUsedIp4Addresses() {
 	return list;
 }
 
-void TunUnix::shutdown() {
+bool TunUnix::shutdown() noexcept {
 	struct ifreq ifr = {};
 
 	int fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -156,11 +278,12 @@ void TunUnix::shutdown() {
 		Logger::error("Getting socket flags with ioctl failed: ", errStr);
 		Logger::error("Please shut down ", name, " manually");
 		close(fd);
-		return;
+		return false;
 	}
 
 	ifr.ifr_flags &= ~IFF_UP & ~IFF_RUNNING;
-	if (ioctl(fd, SIOCSIFFLAGS, &ifr) < 0) {
+	const bool success = ioctl(fd, SIOCSIFFLAGS, &ifr) >= 0;
+	if (!success) {
 		const char *errStr = std::strerror(errno);
 		Logger::error("Setting socket flags with ioctl failed: ", errStr);
 		Logger::error("Please shut down ", name, " manually");
@@ -169,45 +292,610 @@ void TunUnix::shutdown() {
 	}
 
 	close(fd);
+	return success;
+}
+
+bool TunUnix::removeIp() noexcept {
+	if (Netlink::removeAddresses(name)) return true;
+
+	struct ifreq ifr = {};
+	struct sockaddr_in sai = {};
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		const char *errStr = std::strerror(errno);
+		Logger::error("Can't open socket to remove ip: ", errStr);
+		return false;
+	}
+
+	strncpy(ifr.ifr_name, name.c_str(), IFNAMSIZ);
+
+	//Setting 0.0.0.0 deletes the address
+	sai.sin_family = AF_INET;
+	sai.sin_addr.s_addr = INADDR_ANY;
+	memcpy(&ifr.ifr_addr, &sai, sizeof(struct sockaddr));
+
+	const bool success = ioctl(fd, SIOCSIFADDR, &ifr) >= 0;
+	if (!success) {
+		const char *errStr = std::strerror(errno);
+		Logger::error("Removing ip with ioctl failed: ", errStr);
+	}
+
+	close(fd);
+	return success;
+}
+
+bool TunUnix::recycle() noexcept {
+	coalesceLen = 0;
+	if (!shutdown() || !removeIp()) return false;
+
+	//Frames of the last friend must not reach the next one
+	while (true) {
+		Data data;
+		const ToxTun::DropReason reason = getDataBackend(data);
+		if (reason == ToxTun::DropReason::TunReadError) return false;
+		if (reason == ToxTun::DropReason::None && data.empty()) break;
+	}
+	handoffDrops = 0;
+	readErrors = 0;
+
+	forgetPeer();
+	return true;
 }
 
 
-bool TunUnix::dataPending() {
-	fd_set set;
-	FD_ZERO(&set);
-	FD_SET(fd, &set);
-	struct timeval time = {0, 0};
+void TunUnix::startQueues(size_t queues, short flags) {
+	//The workers hand buffers to the thread calling iterate()
+	BufferPool::setThreadSafe();
 
-	if (select(fd+1, &set, nullptr, nullptr, &time) < 0) {
+	wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeFd < 0 || stopFd < 0) {
 		const char *errStr = std::strerror(errno);
-		Logger::error("select failed: ", errStr);
+		throw ToxTunError(Logger::concat("Can't create eventfd: ", errStr));
 	}
 
-	return FD_ISSET(fd, &set);
+	for (size_t i = 1; i < queues; ++i) {
+		const int queueFd = open("/dev/net/tun", O_RDWR | O_NONBLOCK);
+		if (queueFd < 0) {
+			const char *errStr = std::strerror(errno);
+			throw ToxTunError(Logger::concat("Error while opening \"/dev/net/tun\": ", errStr));
+		}
+
+		struct ifreq ifr = {};
+		ifr.ifr_flags = flags;
+		strncpy(ifr.ifr_name, name.c_str(), IFNAMSIZ);
+
+		if (ioctl(queueFd, TUNSETIFF, &ifr) < 0) {
+			std::string errStr(std::strerror(errno));
+			close(queueFd);
+			throw ToxTunError(Logger::concat("Can't attach queue ", i, ": ", errStr));
+		}
+
+		queueFds.push_back(queueFd);
+	}
+
+	try {
+		workers.emplace_back(&TunUnix::worker, this, fd);
+		for (int queueFd : queueFds)
+			workers.emplace_back(&TunUnix::worker, this, queueFd);
+	} catch (std::system_error &error) {
+		throw ToxTunError(Logger::concat("Can't start worker thread: ", error.what()));
+	}
+
+	Logger::debug("Reading ", queues, " queues in worker threads");
 }
 
-Data TunUnix::getDataBackend() {
-	constexpr size_t bufferSize = 1500 + 18; //Max length of an ethernet frame
-	uint8_t buffer[bufferSize];
+void TunUnix::stopQueues() noexcept {
+	if (stopFd >= 0) {
+		const uint64_t one = 1;
+		if (write(stopFd, &one, sizeof(one)) < 0) {
+			const char *errStr = std::strerror(errno);
+			Logger::error("Can't stop worker threads: ", errStr);
+		}
+	}
+
+	for (auto &worker : workers) worker.join();
+	workers.clear();
 
-	int n = read(fd, buffer, bufferSize);
+	for (int queueFd : queueFds) close(queueFd);
+	queueFds.clear();
+
+	if (wakeFd >= 0) close(wakeFd);
+	if (stopFd >= 0) close(stopFd);
+	wakeFd = stopFd = -1;
+
+	handoff.clear();
+}
+
+void TunUnix::worker(int queueFd) noexcept {
+	std::vector<uint8_t> buffer(offload ? superFrameBufferLen : 0);
+	std::deque<Data> frames;
+
+	struct pollfd fds[2] = {};
+	fds[0].fd = queueFd;
+	fds[0].events = POLLIN;
+	fds[1].fd = stopFd;
+	fds[1].events = POLLIN;
+
+	int backoff = 0;
+	while (true) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) continue;
+
+			const char *errStr = std::strerror(errno);
+			Logger::error("poll on tun queue failed: ", errStr);
+			return;
+		}
+
+		if (fds[1].revents) return;
+
+		if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+			Logger::error("Tun queue failed, stopping its worker");
+			++readErrors;
+			handOff(frames); //Wakes up iterate to report the error
+			return;
+		}
+
+		bool failed = false;
+		while (true) {
+			ToxTun::DropReason reason;
+			try {
+				reason = readFrames(queueFd, buffer, frames);
+			} catch (std::bad_alloc &error) {
+				reason = ToxTun::DropReason::NoMemory;
+			}
+
+			if (reason != ToxTun::DropReason::None) {
+				++readErrors;
+				failed = true;
+			}
+			if (frames.empty()) break;
+
+			handOff(frames);
+		}
+
+		if (!failed) {
+			backoff = 0;
+			continue;
+		}
+
+		//A queue failing on every read stays readable
+		handOff(frames);
+		backoff = std::min(backoff ? backoff * 2 : 1, maxReadBackoff);
+		if (poll(&fds[1], 1, backoff) > 0) return;
+	}
+}
+
+void TunUnix::handOff(std::deque<Data> &frames) noexcept {
+	bool wasEmpty;
+	{
+		std::lock_guard<std::mutex> lock(handoffMutex);
+		wasEmpty = handoff.empty();
+
+		for (auto &frame : frames) {
+			if (handoff.size() >= maxHandoff) {
+				++handoffDrops;
+				continue;
+			}
+
+			try {
+				handoff.push_back(std::move(frame));
+			} catch (std::bad_alloc &error) {
+				++handoffDrops;
+			}
+		}
+	}
+	frames.clear();
+
+	//getDataHandoff() only resets wakeFd with an empty handoff
+	if (wasEmpty) {
+		const uint64_t one = 1;
+		if (write(wakeFd, &one, sizeof(one)) < 0) {
+			const char *errStr = std::strerror(errno);
+			Logger::error("Can't wake up iterate: ", errStr);
+		}
+	}
+}
+
+ToxTun::DropReason TunUnix::getDataHandoff(Data &data) noexcept {
+	size_t drops = handoffDrops.load();
+	while (drops && !handoffDrops.compare_exchange_weak(drops, drops - 1)) {}
+	if (drops) return ToxTun::DropReason::TunQueueFull;
+
+	size_t errors = readErrors.load();
+	while (errors && !readErrors.compare_exchange_weak(errors, errors - 1)) {}
+	if (errors) return ToxTun::DropReason::TunReadError;
+
+	std::lock_guard<std::mutex> lock(handoffMutex);
+	if (handoff.empty()) {
+		uint64_t count;
+		if (read(wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+			const char *errStr = std::strerror(errno);
+			Logger::error("Can't reset eventfd: ", errStr);
+		}
+		return ToxTun::DropReason::None;
+	}
+
+	data = std::move(handoff.front());
+	handoff.pop_front();
+
+	return ToxTun::DropReason::None;
+}
+
+int TunUnix::getFd() const noexcept {
+	return (wakeFd >= 0) ? wakeFd : fd;
+}
+
+bool TunUnix::hasPending() const noexcept {
+	//The workers keep wakeFd readable while handoff isn't empty
+	return !pending.empty();
+}
+
+ToxTun::DropReason TunUnix::getDataBackend(Data &data) noexcept {
+	if (wakeFd >= 0) return getDataHandoff(data);
+
+	if (pending.empty()) {
+		ToxTun::DropReason reason;
+		try {
+			reason = readFrames(fd, superFrameBuffer, pending);
+		} catch (std::bad_alloc &error) {
+			Logger::error("Can't allocate memory for frame read from ", name);
+			reason = ToxTun::DropReason::NoMemory;
+		}
+		if (pending.empty()) return reason;
+	}
+
+	data = std::move(pending.front());
+	pending.pop_front();
+
+	return ToxTun::DropReason::None;
+}
+
+ToxTun::DropReason TunUnix::readFrames(
+		int queueFd,
+		std::vector<uint8_t> &buffer,
+		std::deque<Data> &frames
+) {
+	if (!offload) {
+		Data frame = Data::forTunData();
+
+		int n = read(queueFd, frame.getTunBuffer(), Data::maxFrameLen);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return ToxTun::DropReason::None;
+		}
+
+		if (n < 0 || !frame.setIpDataLen(n)) {
+			Logger::debug("Reading from TUN returns ", n);
+			return ToxTun::DropReason::TunReadError;
+		}
+
+		Logger::debug(n, " bytes read from TUN");
+
+		frames.push_back(std::move(frame));
+		return ToxTun::DropReason::None;
+	}
+
+	ssize_t n = read(queueFd, buffer.data(), buffer.size());
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return ToxTun::DropReason::None;
+	}
+
+	if (n < static_cast<ssize_t>(sizeof(VirtioNetHeader))) {
+		Logger::debug("Reading from TUN returns ", n);
+		return ToxTun::DropReason::TunReadError;
+	}
+
+	VirtioNetHeader header;
+	std::memcpy(&header, buffer.data(), sizeof(header));
+
+	const uint8_t *frame = buffer.data() + sizeof(header);
+	const size_t len = n - sizeof(header);
+
+	Logger::debug(len, " bytes read from TUN");
+
+	switch (header.gsoType & ~virtioGsoEcn) {
+		case virtioGsoNone: {
+			Data data = Data::fromTunData(frame, len);
+
+			//The checksum field only holds the sum of the pseudo header
+			if (header.flags & virtioNeedsChecksum) {
+				const size_t start = header.checksumStart;
+				const size_t pos = start + header.checksumOffset;
+				if (start >= len || pos + 2 > len) {
+					return ToxTun::DropReason::TunReadError;
+				}
+
+				uint8_t *ipData = data.getTunBuffer();
+				const uint16_t checksum = Checksum::finish(
+						Checksum::add(ipData + start, len - start)
+				);
+				Checksum::write(ipData + pos, checksum ? checksum : 0xFFFF);
+			}
+
+			frames.push_back(std::move(data));
+			return ToxTun::DropReason::None;
+		}
+		case virtioGsoTcpV4:
+		case virtioGsoTcpV6:
+			return segmentTcp(
+					frame,
+					len,
+					ipOffset,
+					(header.gsoType & ~virtioGsoEcn) == virtioGsoTcpV4,
+					header.checksumStart,
+					header.gsoSize,
+					frames
+			);
+		default:
+			Logger::debug("Unsupported GSO type ", static_cast<int>(header.gsoType));
+			return ToxTun::DropReason::TunReadError;
+	}
+}
+
+ToxTun::DropReason TunUnix::segmentTcp(
+		const uint8_t *frame,
+		size_t len,
+		size_t ipOffset,
+		bool v4,
+		size_t tcpOffset,
+		size_t segmentSize,
+		std::deque<Data> &frames
+) {
+	const size_t ipHeaderLength = v4 ? 20 : 40;
+
+	if (tcpOffset < ipOffset + ipHeaderLength || tcpOffset + 20 > len) {
+		return ToxTun::DropReason::TunReadError;
+	}
+
+	const size_t headerLength = tcpOffset + (frame[tcpOffset + 12] >> 4) * 4;
+	if (headerLength >= len || headerLength + 1 >= TOX_MAX_CUSTOM_PACKET_SIZE) {
+		return ToxTun::DropReason::TunReadError;
+	}
+
+	//Segment straight into frames fitting a single tox packet
+	const size_t mss = std::min(
+			segmentSize ? segmentSize : len,
+			TOX_MAX_CUSTOM_PACKET_SIZE - 1 - headerLength
+	);
+
+	const uint8_t *tcp = frame + tcpOffset;
+	const uint32_t seq = static_cast<uint32_t>(get16(tcp + 4)) << 16 | get16(tcp + 6);
+	uint16_t id = v4 ? get16(frame + ipOffset + 4) : 0;
+	const size_t framesBefore = frames.size();
+
+	for (size_t pos = headerLength; pos < len; pos += mss) {
+		const size_t segmentLen = std::min(mss, len - pos);
+		const size_t frameLen = headerLength + segmentLen;
+
+		Data data = Data::forTunData();
+		uint8_t *out = data.getTunBuffer();
+		std::memcpy(out, frame, headerLength);
+		std::memcpy(out + headerLength, frame + pos, segmentLen);
+
+		uint8_t *ip = out + ipOffset;
+		uint8_t *outTcp = out + tcpOffset;
+		uint32_t sum;
+		if (v4) {
+			const size_t ihl = (ip[0] & 0x0F) * 4;
+			put16(ip + 2, frameLen - ipOffset);
+			put16(ip + 4, id++);
+			put16(ip + 10, 0);
+			Checksum::write(ip + 10, Checksum::finish(Checksum::add(ip, ihl)));
+			sum = Checksum::add(ip + 12, 8);
+		} else {
+			put16(ip + 4, frameLen - ipOffset - 40);
+			sum = Checksum::add(ip + 8, 32);
+		}
+
+		const uint32_t segmentSeq = seq + (pos - headerLength);
+		put16(outTcp + 4, segmentSeq >> 16);
+		put16(outTcp + 6, segmentSeq & 0xFFFF);
+		if (pos + segmentLen < len) outTcp[13] &= ~(0x01 | 0x08); //FIN and PSH only on the last
+		if (pos != headerLength) outTcp[13] &= ~0x80; //CWR only on the first
+		put16(outTcp + 16, 0);
+
+		const size_t tcpLen = frameLen - tcpOffset;
+		sum += 6 + tcpLen;
+		sum = Checksum::add(outTcp, tcpLen, sum);
+		Checksum::write(outTcp + 16, Checksum::finish(sum));
+
+		data.setIpDataLen(frameLen);
+		frames.push_back(std::move(data));
+	}
+
+	Logger::debug("Segmented super-frame into ", frames.size() - framesBefore, " frames");
+
+	return ToxTun::DropReason::None;
+}
+
+ToxTun::DropReason TunUnix::sendDataBackend(const Data &data) noexcept {
+	const uint8_t *frame = data.getIpData();
+	const size_t len = data.getIpDataLen();
+
+	if (!offload) return writeFrame(frame, len);
+
+	bool complete;
+	if (coalesceLen && coalesce(frame, len, complete))
+		return complete ? flush() : ToxTun::DropReason::None;
+
+	//Keep the order, the super-frame has to be written first
+	const ToxTun::DropReason reason = flush();
+	if (startCoalescing(frame, len)) return reason;
+
+	const ToxTun::DropReason frameReason = writeFrame(frame, len);
+	return (reason != ToxTun::DropReason::None) ? reason : frameReason;
+}
+
+size_t TunUnix::getCoalescableTcpOffset(const uint8_t *frame, size_t len) const noexcept {
+	if (len < ipOffset + 40) return 0;
+
+	const uint8_t *ip = frame + ipOffset;
+	size_t tcpOffset;
+
+	const uint8_t version = getIpVersion(frame, len);
+	if (version == 4) {
+		if (ip[0] != 0x45 || ip[9] != 0x06) return 0; //IP options or no TCP
+		if ((ip[6] & 0x3F) | ip[7]) return 0; //Fragmented
+		if (get16(ip + 2) != len - ipOffset) return 0; //Padded
+		tcpOffset = ipOffset + 20;
+	} else if (version == 6) {
+		if (len < ipOffset + 60) return 0;
+		if (ip[6] != 0x06) return 0; //Extension headers or no TCP
+		if (get16(ip + 4) != len - ipOffset - 40) return 0; //Padded
+		tcpOffset = ipOffset + 40;
+	} else {
+		return 0;
+	}
+
+	const uint8_t *tcp = frame + tcpOffset;
+	const size_t tcpHeaderLength = (tcp[12] >> 4) * 4;
+	if (tcpHeaderLength < 20 || tcpOffset + tcpHeaderLength >= len) return 0; //No payload
+
+	//Only ACK and PSH, everything else has to be seen by itself
+	if ((tcp[13] & ~0x18) != 0 || (tcp[13] & 0x10) == 0) return 0;
+
+	return tcpOffset;
+}
+
+bool TunUnix::startCoalescing(const uint8_t *frame, size_t len) noexcept {
+	const size_t tcpOffset = getCoalescableTcpOffset(frame, len);
+	if (!tcpOffset) return false;
+
+	const uint8_t *tcp = frame + tcpOffset;
+	if (tcp[13] & 0x08) return false; //PSH, nothing will follow
+
+	const size_t payloadLen = len - tcpOffset - (tcp[12] >> 4) * 4;
+
+	std::memcpy(coalesceBuffer.data() + sizeof(VirtioNetHeader), frame, len);
+	coalesceLen = len;
+	coalesceSegments = 1;
+	coalesceSegmentSize = payloadLen;
+	coalesceTcpOffset = tcpOffset;
+	coalesceNextSeq = (static_cast<uint32_t>(get16(tcp + 4)) << 16 | get16(tcp + 6)) + payloadLen;
+
+	return true;
+}
+
+bool TunUnix::coalesce(const uint8_t *frame, size_t len, bool &complete) noexcept {
+	const size_t tcpOffset = getCoalescableTcpOffset(frame, len);
+	if (tcpOffset != coalesceTcpOffset) return false;
+
+	uint8_t *superFrame = coalesceBuffer.data() + sizeof(VirtioNetHeader);
+	const uint8_t *ip = frame + ipOffset;
+	const uint8_t *superIp = superFrame + ipOffset;
+	const uint8_t *tcp = frame + tcpOffset;
+	uint8_t *superTcp = superFrame + tcpOffset;
+
+	if (std::memcmp(frame, superFrame, ipOffset) != 0) return false;
+
+	if (tcpOffset == ipOffset + 20) {
+		//TOS, DF, TTL, protocol and addresses
+		if (ip[1] != superIp[1] || ip[6] != superIp[6] || ip[8] != superIp[8]) return false;
+		if (std::memcmp(ip + 12, superIp + 12, 8) != 0) return false;
+	} else {
+		//Everything except the payload length
+		if (std::memcmp(ip, superIp, 4) != 0) return false;
+		if (std::memcmp(ip + 6, superIp + 6, 34) != 0) return false;
+	}
+
+	//Same ports, ack, header length, window and options
+	const size_t tcpHeaderLength = (tcp[12] >> 4) * 4;
+	if (std::memcmp(tcp, superTcp, 4) != 0) return false;
+	if (std::memcmp(tcp + 8, superTcp + 8, 5) != 0) return false;
+	if (std::memcmp(tcp + 14, superTcp + 14, 2) != 0) return false;
+	if (std::memcmp(tcp + 20, superTcp + 20, tcpHeaderLength - 20) != 0) return false;
+
+	const uint32_t seq = static_cast<uint32_t>(get16(tcp + 4)) << 16 | get16(tcp + 6);
+	if (seq != coalesceNextSeq) return false;
+
+	const size_t payloadLen = len - tcpOffset - tcpHeaderLength;
+	if (payloadLen > coalesceSegmentSize) return false;
+	if (coalesceLen + payloadLen - ipOffset > 65535) return false;
+
+	std::memcpy(superFrame + coalesceLen, tcp + tcpHeaderLength, payloadLen);
+	coalesceLen += payloadLen;
+	coalesceNextSeq += payloadLen;
+	++coalesceSegments;
+
+	//Segments after a shorter one or a PSH would change the segmentation
+	if (tcp[13] & 0x08) superTcp[13] |= 0x08;
+	complete = (tcp[13] & 0x08) || payloadLen < coalesceSegmentSize;
+
+	return true;
+}
+
+ToxTun::DropReason TunUnix::flush() noexcept {
+	if (!coalesceLen) return ToxTun::DropReason::None;
+
+	uint8_t *superFrame = coalesceBuffer.data() + sizeof(VirtioNetHeader);
+	const size_t len = coalesceLen;
+	coalesceLen = 0;
+
+	if (coalesceSegments == 1) return writeFrame(superFrame, len);
+
+	uint8_t *ip = superFrame + ipOffset;
+	uint8_t *tcp = superFrame + coalesceTcpOffset;
+	const bool v4 = (coalesceTcpOffset == ipOffset + 20);
+	const size_t tcpLen = len - coalesceTcpOffset;
+
+	uint32_t sum;
+	if (v4) {
+		put16(ip + 2, len - ipOffset);
+		put16(ip + 10, 0);
+		Checksum::write(ip + 10, Checksum::finish(Checksum::add(ip, 20)));
+		sum = Checksum::add(ip + 12, 8);
+	} else {
+		put16(ip + 4, len - ipOffset - 40);
+		sum = Checksum::add(ip + 8, 32);
+	}
+
+	//The kernel completes the checksum, it only wants the pseudo header
+	sum += 6 + tcpLen;
+	Checksum::write(tcp + 16, ~Checksum::finish(sum) & 0xFFFF);
+
+	VirtioNetHeader header = {};
+	header.flags = virtioNeedsChecksum;
+	header.gsoType = v4 ? virtioGsoTcpV4 : virtioGsoTcpV6;
+	header.headerLength = coalesceTcpOffset + (tcp[12] >> 4) * 4;
+	header.gsoSize = coalesceSegmentSize;
+	header.checksumStart = coalesceTcpOffset;
+	header.checksumOffset = 16;
+	std::memcpy(coalesceBuffer.data(), &header, sizeof(header));
+
+	const ssize_t n = write(fd, coalesceBuffer.data(), sizeof(header) + len);
 	if (n < 0) {
-		throw ToxTunError(Logger::concat("Reading from TUN returns ", n));
+		Logger::debug("Writing to tun failed: ", std::strerror(errno));
+		return ToxTun::DropReason::TunWriteError;
 	}
 
-	Logger::debug(n, " bytes read from TUN");
+	Logger::debug("Wrote ", coalesceSegments, " merged segments to TUN");
 
-	return Data::fromTunData(buffer, n);
+	return ToxTun::DropReason::None;
 }
 
-void TunUnix::sendData(const Data &data) {
-	int n = write(fd, data.getIpData(), data.getIpDataLen());
+ToxTun::DropReason TunUnix::writeFrame(const uint8_t *frame, size_t len) noexcept {
+	int n;
+	if (offload) {
+		VirtioNetHeader header = {};
+		struct iovec iov[2];
+		iov[0].iov_base = &header;
+		iov[0].iov_len = sizeof(header);
+		iov[1].iov_base = const_cast<uint8_t*>(frame);
+		iov[1].iov_len = len;
+		n = writev(fd, iov, 2);
+	} else {
+		n = write(fd, frame, len);
+	}
+
 	if (n < 0) {
-		const char *errStr = std::strerror(errno);
-		throw ToxTunError(Logger::concat("Writing to tun failed: ", errStr));
+		Logger::debug("Writing to tun failed: ", std::strerror(errno));
+		return ToxTun::DropReason::TunWriteError;
 	}
 
 	Logger::debug(n, " bytes written to TUN");
+
+	return ToxTun::DropReason::None;
 }
 
 #endif //__unix
@@ -23,10 +23,16 @@
 #ifdef __unix
 
 #include "Tun.hpp"
+#include "Data.hpp"
 
 #include <string>
 #include <list>
 #include <array>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 /**
  * The unix backend for TunInterface
@@ -36,15 +42,187 @@ class TunUnix : public TunInterface {
 		const int fd; /**< file desctiptor of tun interface */
 		std::string name; /**< name of tun interface */
 
-		void shutdown();
-		virtual Data getDataBackend() final;
+		/**
+		 * Maximal number of frames waiting in handoff.
+		 */
+		static constexpr size_t maxHandoff = 1024;
+
+		/**
+		 * Maximal milliseconds a worker waits after failed reads.
+		 */
+		static constexpr int maxReadBackoff = 1000;
+
+		/**
+		 * File descriptors of the additional queues in multi queue mode.
+		 * fd is the first queue.
+		 */
+		std::vector<int> queueFds;
+
+		/**
+		 * eventfd readable while there are frames in handoff.
+		 * -1 if not in multi queue mode.
+		 */
+		int wakeFd;
+
+		/**
+		 * eventfd to stop the workers.
+		 * -1 if not in multi queue mode.
+		 */
+		int stopFd;
+
+		std::vector<std::thread> workers; /**< One reading thread per queue */
+		std::mutex handoffMutex; /**< Protects handoff */
+		std::deque<Data> handoff; /**< Frames read by the workers */
+		std::atomic<size_t> handoffDrops; /**< Frames dropped because handoff was full */
+		std::atomic<size_t> readErrors; /**< Failed reads of the workers */
+
+		/**
+		 * Whether or not frames are prefixed with a virtio net header
+		 * and TCP super-frames have to be segmented.
+		 */
+		const bool offload;
+
+		/**
+		 * Bytes needed to read a virtio net header and a super-frame.
+		 */
+		static const size_t superFrameBufferLen;
+
+		std::vector<uint8_t> superFrameBuffer; /**< Used by getDataBackend() if offload */
+		std::deque<Data> pending; /**< Segments not returned by getDataBackend() yet */
+
+		/**
+		 * Virtio net header and the TCP super-frame merged from the
+		 * segments passed to sendData(), if offload is set.
+		 */
+		std::vector<uint8_t> coalesceBuffer;
+		size_t coalesceLen; /**< Length of the super-frame, 0 if there is none */
+		size_t coalesceSegments; /**< Number of merged segments */
+		size_t coalesceSegmentSize; /**< TCP payload of the first segment */
+		size_t coalesceTcpOffset; /**< Offset of the TCP header */
+		uint32_t coalesceNextSeq; /**< Sequence number the next segment must have */
+
+		/**
+		 * Opens the additional queues and starts a worker for every queue.
+		 * Throws ToxTunError in case of failure.
+		 */
+		void startQueues(size_t queues, short flags);
+
+		/**
+		 * Stops the workers and closes the additional queues.
+		 */
+		void stopQueues() noexcept;
+
+		/**
+		 * Reads frames from queueFd into handoff until stopFd is signaled
+		 * or the queue fails.
+		 * Waits up to maxReadBackoff milliseconds after failed reads.
+		 * Runs in its own thread.
+		 */
+		void worker(int queueFd) noexcept;
+
+		/**
+		 * Moves frames to handoff and wakes up iterate if necessary.
+		 * Called by worker()
+		 */
+		void handOff(std::deque<Data> &frames) noexcept;
+
+		/**
+		 * Reads one frame from queueFd. If offload is set, a super-frame
+		 * is segmented into multiple frames.
+		 * \param[in] buffer Buffer of superFrameBufferLen bytes if offload is set
+		 * \param[out] frames Read frames are appended, nothing is appended
+		 * if there is nothing to read
+		 * \return ToxTun::DropReason::None on success
+		 * Throws std::bad_alloc if no memory is avaible, the frames
+		 * appended so far are complete.
+		 */
+		ToxTun::DropReason readFrames(
+				int queueFd,
+				std::vector<uint8_t> &buffer,
+				std::deque<Data> &frames
+		);
+
+		/**
+		 * Gets the offset of the TCP header if frame is a TCP segment
+		 * with payload that may be merged with others.
+		 * \return 0 if frame can't be merged
+		 */
+		size_t getCoalescableTcpOffset(const uint8_t *frame, size_t len) const noexcept;
+
+		/**
+		 * Starts a new super-frame with frame.
+		 * \return false if frame can't be merged
+		 */
+		bool startCoalescing(const uint8_t *frame, size_t len) noexcept;
+
+		/**
+		 * Appends frame to the super-frame.
+		 * \param[out] complete Set to true if no further segment may
+		 * follow and the super-frame has to be flushed
+		 * \return false if frame doesn't belong to it
+		 */
+		bool coalesce(const uint8_t *frame, size_t len, bool &complete) noexcept;
+
+		/**
+		 * Writes frame to queue fd, with an empty virtio net header
+		 * if offload is set.
+		 */
+		ToxTun::DropReason writeFrame(const uint8_t *frame, size_t len) noexcept;
+
+		/**
+		 * Segments a TCP super-frame into frames fitting a single tox packet.
+		 * Called by readFrames()
+		 * \param[in] ipOffset Offset of the IP header in frame
+		 * \param[in] v4 Whether the frame is IPv4 or IPv6
+		 * \param[in] tcpOffset Offset of the TCP header in frame
+		 * \param[in] segmentSize Maximal TCP payload announced by the kernel
+		 * \param[out] frames Segments are appended
+		 * Throws std::bad_alloc if no memory is avaible, the segments
+		 * appended so far are complete.
+		 */
+		static ToxTun::DropReason segmentTcp(
+				const uint8_t *frame,
+				size_t len,
+				size_t ipOffset,
+				bool v4,
+				size_t tcpOffset,
+				size_t segmentSize,
+				std::deque<Data> &frames
+		);
+
+		/**
+		 * Called by getDataBackend() in multi queue mode
+		 * \sa getDataBackend()
+		 */
+		ToxTun::DropReason getDataHandoff(Data &data) noexcept;
+
+		/**
+		 * Takes the interface down.
+		 * \return false on failure
+		 */
+		bool shutdown() noexcept;
+
+		/**
+		 * Removes the IPv4 and IPv6 addresses of the interface.
+		 * Without rtnetlink only the IPv4 address is removed.
+		 * \return false on failure
+		 */
+		bool removeIp() noexcept;
+
+		virtual ToxTun::DropReason getDataBackend(Data &data) noexcept final;
+		virtual ToxTun::DropReason sendDataBackend(const Data &data) noexcept final;
 		virtual std::list<std::array<uint8_t, 4>> getUsedIp4Addresses() final;
 
 	public:
+		/**
+		 * Whether or not Options::layer3 is supported.
+		 */
+		static constexpr bool layer3Supported = true;
+
 		/**
 		 * Creates the tun interface
 		 */
-		TunUnix(const Tox *tox);
+		TunUnix(const Tox *tox, const Options &options);
 
 		TunUnix(const TunUnix&) = delete; /**< Deleted */
 		TunUnix& operator=(const TunUnix&) = delete; /**< Deleted */
@@ -55,8 +233,19 @@ class TunUnix : public TunInterface {
 		~TunUnix();
 
 		virtual void setIp(uint8_t subnet, uint8_t postfix) noexcept final;
-		virtual bool dataPending() final;
-		virtual void sendData(const Data &data) final;
+		virtual bool setMtu(uint16_t mtu) noexcept final;
+		virtual bool configure(uint8_t subnet, uint8_t postfix, uint16_t mtu) noexcept final;
+		virtual bool isAddrspaceUnused(uint8_t addrSpace) final;
+		virtual ToxTun::DropReason flush() noexcept final;
+		virtual bool recycle() noexcept final;
+		virtual bool hasPending() const noexcept final;
+
+		/**
+		 * Gets the file descriptor of the tun interface.
+		 * In multi queue mode this is an eventfd readable while the
+		 * workers have read frames.
+		 */
+		int getFd() const noexcept;
 };
 
 #endif //__unix
@@ -24,16 +24,23 @@
 
 #include <iphlpapi.h>
 #include <winioctl.h>
+#include <new>
 
-TunWin::TunWin(const Tox *tox)
+constexpr bool TunWin::layer3Supported;
+
+TunWin::TunWin(const Tox *tox, const Options &options)
 :
-	TunInterface(tox),
+	TunInterface(tox, Options{1, false, false}),
 	handle(INVALID_HANDLE_VALUE),
 	ipPostfix(255),
 	bytesRead(0),
 	readState(ReadState::Idle),
 	ipIsSet(false)
 {
+	if (options.queues > 1) {
+		Logger::debug("Multiple queues aren't supported on windows, using one");
+	}
+
 	constexpr char ADAPTER_KEY[] = "SYSTEM\\CurrentControlSet\\Control\\Class\\{4D36E972-E325-11CE-BFC1-08002BE10318}";
 	HKEY adapterKey;
 	LONG status;
@@ -257,6 +264,11 @@ void TunWin::setIp(uint8_t subnet, uint8_t postfix) noexcept {
 	Logger::debug("Tun device successfully started");
 }
 
+bool TunWin::setMtu(uint16_t mtu) noexcept {
+	Logger::error("Setting the MTU isn't supported on windows, please set it to ", mtu, " manually");
+	return false;
+}
+
 ULONG TunWin::getAdapterIndex() const {
 	DWORD index, status;
 
@@ -358,7 +370,15 @@ std::list<std::array<uint8_t, 4>> TunWin::getUsedIp4Addresses() {
 	return usedIps;
 }
 
-bool TunWin::dataPending() {
+bool TunWin::dataPending() noexcept {
+	try {
+		return dataPendingBackend();
+	} catch (ToxTunError &error) {
+		return false;
+	}
+}
+
+bool TunWin::dataPendingBackend() {
 	switch (readState) {
 		case ReadState::Queued:
 			if (HasOverlappedIoCompleted(&overlappedRead)) {
@@ -419,20 +439,35 @@ void TunWin::setBytesRead() {
 	}
 }
 
-Data TunWin::getDataBackend() {
-	if (readState != ReadState::Ready) {
-		throw ToxTunError("Wrong readState in getData");
+ToxTun::DropReason TunWin::getDataBackend(Data &data) noexcept {
+	if (!dataPending()) return ToxTun::DropReason::None;
+
+	ToxTun::DropReason reason = ToxTun::DropReason::None;
+	try {
+		data = Data::fromTunData(readBuffer, bytesRead);
+	} catch (std::bad_alloc &error) {
+		reason = ToxTun::DropReason::NoMemory;
 	}
 
 	readState = ReadState::Idle;
-	queueRead();
+	try {
+		queueRead();
+	} catch (ToxTunError &error) {}
 
 	Logger::debug("readBuffer returned");
 
-	return Data::fromTunData(readBuffer, bytesRead);
+	return reason;
 }
 
-void TunWin::sendData(const Data &data) {
+ToxTun::DropReason TunWin::flush() noexcept {
+	return ToxTun::DropReason::None;
+}
+
+bool TunWin::recycle() noexcept {
+	return false;
+}
+
+ToxTun::DropReason TunWin::sendDataBackend(const Data &data) noexcept {
 	bool status;
 	DWORD written;
 
@@ -451,7 +486,8 @@ void TunWin::sendData(const Data &data) {
 		overlappedWrite.pop_front();
 	} else {
 		if (GetLastError() != ERROR_IO_PENDING) {
-			throw ToxTunError("Writing to tun failed");
+			Logger::debug("Writing to tun failed");
+			return ToxTun::DropReason::TunWriteError;
 		}
 	}
 
@@ -460,6 +496,8 @@ void TunWin::sendData(const Data &data) {
 	}
 
 	Logger::debug(written, " bytes written to TUN");
+
+	return ToxTun::DropReason::None;
 }
 
 #endif //_WIN32
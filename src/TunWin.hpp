@@ -57,6 +57,19 @@ class TunWin : public TunInterface {
 		 */
 		void queueRead();
 
+		/**
+		 * Indicates wether or not there is pending data to be
+		 * read from tun interface.
+		 * \return true if there is pending data, false otherwise
+		 */
+		bool dataPending() noexcept;
+
+		/**
+		 * Called by dataPending()
+		 * Throws Error in case of failure.
+		 */
+		bool dataPendingBackend();
+
 		/**
 		 * Sets bytesRead, using the info from overlappedRead
 		 */
@@ -69,15 +82,23 @@ class TunWin : public TunInterface {
 		DWORD getAdapterIndex() const;
 
 		void unsetIp();
-		virtual Data getDataBackend() final;
+		virtual ToxTun::DropReason getDataBackend(Data &data) noexcept final;
+		virtual ToxTun::DropReason sendDataBackend(const Data &data) noexcept final;
 
 		virtual std::list<std::array<uint8_t, 4>> getUsedIp4Addresses() final;
 
 	public:
+		/**
+		 * Whether or not Options::layer3 is supported.
+		 */
+		static constexpr bool layer3Supported = false;
+
 		/**
 		 * Creates the tun interface
+		 * Multiple queues, offloading and layer 3 mode aren't supported
+		 * and ignored.
 		 */
-		TunWin(const Tox *tox);
+		TunWin(const Tox *tox, const Options &options);
 
 		TunWin(const TunWin&) = delete; /**< Deleted */
 		TunWin& operator=(const TunWin&) = delete; /**< Deleted */
@@ -88,8 +109,9 @@ class TunWin : public TunInterface {
 		~TunWin();
 
 		virtual void setIp(uint8_t subnet, uint8_t postfix) noexcept final;
-		virtual bool dataPending() final;
-		virtual void sendData(const Data &data) final;
+		virtual bool setMtu(uint16_t mtu) noexcept final;
+		virtual ToxTun::DropReason flush() noexcept final;
+		virtual bool recycle() noexcept final;
 };
 
 #undef ERROR //qTox has a conflicting enum, so undef it for now